@@ -0,0 +1,287 @@
+// Mixed workload benchmark for DbStore.
+//
+//   node bench/bench.js [--option=value ...]
+//
+// Loads `keys` records, then runs `concurrency` parallel loops of gets and
+// puts for `seconds`, and reports throughput and latency percentiles.
+// With batch > 1 every operation is a getMany or putMany of that many
+// keys, and latencies are per batch.
+//
+// Options (defaults in brackets):
+//   file          database file [bench.db], removed first unless --keep
+//   type          access method [btree]
+//   keys          number of distinct keys [100000]
+//   keySize       key length in bytes [16]
+//   valueSize     value length in bytes [100]
+//   dist          uniform or zipf [zipf]
+//   theta         zipf skew, 0 < theta < 1 [0.99]
+//   reads         fraction of operations that are reads [0.9]
+//   concurrency   operations in flight at once [32]
+//   batch         keys per operation [1]
+//   seconds       length of the measured run [10]
+//   warmup        seconds run before measuring [2]
+//   sync          use getSync for reads [false]
+//   cacheSize     environment cache in bytes, opens a DbEnv in bench-env/
+//   valueCache, compress, writeBehind, btreeCompress, pageSize
+//                 passed to open
+//   json          print the results as one JSON line
+var fs = require('fs');
+var path = require('path');
+var DbStore = require('..');
+
+function parse_args(argv) {
+  var opts = {
+    file: 'bench.db', type: 'btree', keys: 100000, keySize: 16,
+    valueSize: 100, dist: 'zipf', theta: 0.99, reads: 0.9,
+    concurrency: 32, batch: 1, seconds: 10, warmup: 2
+  };
+  argv.forEach(function (arg) {
+    var m = /^--([^=]+)(?:=(.*))?$/.exec(arg);
+    if (! m) {
+      throw new Error("Unknown argument " + arg);
+    }
+    var val = m[2] === undefined ? true : m[2];
+    if (val === 'true') val = true;
+    else if (val === 'false') val = false;
+    else if (typeof val == 'string' && val !== '' && ! isNaN(+val)) val = +val;
+    opts[m[1]] = val;
+  });
+  return opts;
+}
+
+// Keys are fixed width: the record number in decimal, zero padded or
+// truncated to keySize.  Record numbers are scrambled so the hot keys of a
+// zipf run are spread over the tree rather than packed into a few pages.
+function Keys(opts) {
+  this.n = opts.keys;
+  this.size = opts.keySize;
+  this.next = opts.dist == 'zipf' ? zipf(this.n, opts.theta) : uniform(this.n);
+}
+
+Keys.prototype.key = function (i) {
+  var s = String(scramble(i, this.n));
+  while (s.length < this.size) s = '0' + s;
+  return s.slice(s.length - this.size);
+};
+
+Keys.prototype.pick = function () {
+  return this.key(this.next());
+};
+
+function scramble(i, n) {
+  // 2654435761 is prime, so this is a permutation for n not a multiple of it
+  return (i * 2654435761) % n;
+}
+
+function uniform(n) {
+  return function () { return Math.floor(Math.random() * n); };
+}
+
+// Gray et al., "Quickly generating billion-record synthetic databases"
+function zipf(n, theta) {
+  var zetan = 0;
+  for (var i = 1; i <= n; ++i) zetan += 1 / Math.pow(i, theta);
+  var zeta2 = 1 + 1 / Math.pow(2, theta);
+  var alpha = 1 / (1 - theta);
+  var eta = (1 - Math.pow(2 / n, 1 - theta)) / (1 - zeta2 / zetan);
+
+  return function () {
+    var u = Math.random();
+    var uz = u * zetan;
+    if (uz < 1) return 0;
+    if (uz < zeta2) return 1;
+    return Math.min(n - 1, Math.floor(n * Math.pow(eta * u - eta + 1, alpha)));
+  };
+}
+
+// Latency samples in microseconds, one array per kind of operation
+function Recorder() {
+  this.samples = { get: [], put: [] };
+  this.ops = { get: 0, put: 0 };
+  this.errors = 0;
+}
+
+Recorder.prototype.add = function (kind, start, n) {
+  var d = process.hrtime(start);
+  this.samples[kind].push(d[0] * 1e6 + d[1] / 1e3);
+  this.ops[kind] += n;
+};
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) return 0;
+  var i = Math.min(sorted.length - 1, Math.floor(p * sorted.length));
+  return sorted[i];
+}
+
+Recorder.prototype.report = function (seconds) {
+  var result = { seconds: seconds, errors: this.errors, ops: {} };
+  var total = 0;
+  for (var kind in this.samples) {
+    var s = this.samples[kind].sort(function (a, b) { return a - b; });
+    total += this.ops[kind];
+    result.ops[kind] = {
+      count: this.ops[kind],
+      opsPerSec: Math.round(this.ops[kind] / seconds),
+      p50: +percentile(s, 0.5).toFixed(1),
+      p99: +percentile(s, 0.99).toFixed(1),
+      p999: +percentile(s, 0.999).toFixed(1),
+      max: +(s.length ? s[s.length - 1] : 0).toFixed(1)
+    };
+  }
+  result.opsPerSec = Math.round(total / seconds);
+  return result;
+};
+
+function store_options(opts, env) {
+  var o = { type: opts.type };
+  ['valueCache', 'compress', 'btreeCompress', 'pageSize'].forEach(function (name) {
+    if (opts[name] !== undefined) o[name] = opts[name];
+  });
+  if (opts.writeBehind) {
+    o.writeBehind = opts.writeBehind === true ? {} : { interval: opts.writeBehind };
+  }
+  if (env) o.env = env;
+  return o;
+}
+
+function open(opts, cb) {
+  if (! opts.keep) {
+    try { fs.unlinkSync(opts.file); } catch (x) {}
+  }
+  var store = new DbStore();
+  if (! opts.cacheSize) {
+    return store.open(opts.file, store_options(opts), function (err) {
+      cb(err, store);
+    });
+  }
+
+  var home = path.resolve('bench-env');
+  if (! fs.existsSync(home)) fs.mkdirSync(home);
+  var env = new DbStore.DbEnv();
+  env.open(home, { cacheSize: opts.cacheSize }, function (err) {
+    if (err) return cb(err);
+    store.open(opts.file, store_options(opts, env), function (err) {
+      cb(err, store, env);
+    });
+  });
+}
+
+function load(store, keys, opts, cb) {
+  var value = new Buffer(opts.valueSize);
+  value.fill(120);
+  var chunk = 1000, i = 0;
+  (function next() {
+    if (i >= keys.n) return store.flush ? store.flush(cb) : cb(null);
+    var pairs = [];
+    for (var end = Math.min(keys.n, i + chunk); i < end; ++i) {
+      pairs.push([keys.key(i), value]);
+    }
+    store.putMany(pairs, function (err) {
+      if (err) return cb(err);
+      next();
+    });
+  })();
+}
+
+function run(store, keys, opts, cb) {
+  var value = new Buffer(opts.valueSize);
+  value.fill(121);
+
+  var rec = new Recorder();
+  var measuring = false, stopping = false, running = 0;
+  var started;
+
+  function batch() {
+    var ks = new Array(opts.batch);
+    for (var i = 0; i < opts.batch; ++i) ks[i] = keys.pick();
+    return ks;
+  }
+
+  function loop() {
+    if (stopping) {
+      if (--running === 0) finish();
+      return;
+    }
+
+    var read = Math.random() < opts.reads;
+    var kind = read ? 'get' : 'put';
+    var start = process.hrtime();
+    function done(err) {
+      if (err && ! read) rec.errors++;
+      if (measuring) rec.add(kind, start, opts.batch);
+      loop();
+    }
+
+    if (opts.batch > 1) {
+      var ks = batch();
+      if (read) return store.getMany(ks, done);
+      return store.putMany(ks.map(function (k) { return [k, value]; }), done);
+    }
+
+    var key = keys.pick();
+    if (read && opts.sync) {
+      store.getSync(key);
+      if (measuring) rec.add(kind, start, 1);
+      // Let I/O in between synchronous reads
+      return setImmediate(loop);
+    }
+    if (read) return store.get(key, done);
+    store.put(key, value, done);
+  }
+
+  function finish() {
+    var elapsed = process.hrtime(started);
+    cb(null, rec.report(elapsed[0] + elapsed[1] / 1e9));
+  }
+
+  for (running = 0; running < opts.concurrency; ++running) loop();
+  setTimeout(function () {
+    measuring = true;
+    started = process.hrtime();
+    setTimeout(function () { stopping = true; }, opts.seconds * 1000);
+  }, opts.warmup * 1000);
+}
+
+function print(opts, result) {
+  if (opts.json) {
+    result.options = opts;
+    return console.log(JSON.stringify(result));
+  }
+  console.log("%s %s keys=%d key=%dB value=%dB reads=%d%% concurrency=%d batch=%d",
+              opts.type, opts.dist, opts.keys, opts.keySize, opts.valueSize,
+              Math.round(opts.reads * 100), opts.concurrency, opts.batch);
+  console.log("total %d ops/s over %ss, %d errors", result.opsPerSec,
+              result.seconds.toFixed(1), result.errors);
+  for (var kind in result.ops) {
+    var r = result.ops[kind];
+    if (! r.count) continue;
+    console.log("  %s %d ops/s  p50 %dus  p99 %dus  p999 %dus  max %dus",
+                kind, r.opsPerSec, r.p50, r.p99, r.p999, r.max);
+  }
+}
+
+function main() {
+  var opts = parse_args(process.argv.slice(2));
+  var keys = new Keys(opts);
+
+  open(opts, function (err, store, env) {
+    if (err) throw err;
+    load(store, keys, opts, function (err) {
+      if (err) throw err;
+      run(store, keys, opts, function (err, result) {
+        if (err) throw err;
+        print(opts, result);
+        store.close(function (err) {
+          if (err) throw err;
+          if (env) env.close(function () {});
+        });
+      });
+    });
+  });
+}
+
+if (require.main === module) {
+  main();
+}
+
+module.exports = { Keys: Keys, Recorder: Recorder, parse_args: parse_args };
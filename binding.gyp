@@ -2,10 +2,13 @@
   "targets": [
     {
       "target_name": "addon",
-      "sources": [ "src/addon.cc", "src/dbstore.cc", "src/dbenv.cc" ],
+      "sources": [ "src/addon.cc", "src/dbstore.cc", "src/dbenv.cc", "src/dbtxn.cc",
+                   "src/bufpool.cc", "src/workpool.cc", "src/valuecache.cc",
+                   "src/codec.cc", "src/writebuffer.cc",
+                   "src/opstats.cc", "src/ttl.cc", "src/extractor.cc" ],
       "include_dirs": [ "../include", "./deps/db-6.0.20/build_unix"],
       "link_settings": {
-        "libraries": [ "-L../lib", "-L../deps/db-6.0.20/build_unix", "-ldb-6.0" ]
+        "libraries": [ "-L../lib", "-L../deps/db-6.0.20/build_unix", "-ldb-6.0", "-lz" ]
       }
     }
   ]
@@ -3,12 +3,13 @@ var addon = require("bindings")("addon.node");
 var DbStore = addon.DbStore;
 
 DbStore.DbEnv = addon.DbEnv;
+DbStore.DbTxn = addon.DbTxn;
 
-DbStore.prototype.put = function (key, val, opts, cb) {
-  if (typeof opts == 'function') {
-    cb = opts; opts = {};
-  }
+// Thread counts for the database workers, { readers, writers }.  Only
+// possible before the first store or environment is opened.
+DbStore.configureWorkers = addon.configureWorkers;
 
+function encode(val, opts, cb) {
   if (opts.json) {
     val = JSON.stringify(val);
   }
@@ -18,22 +19,103 @@ DbStore.prototype.put = function (key, val, opts, cb) {
     buf = new Buffer(val, 'utf8');
   }
 
+  if (! opts.zlib) {
+    return cb(null, buf);
+  }
+
+  var zlib = require('zlib');
+  zlib.deflateRaw(buf, cb);
+}
+
+// The native write calls take the value(s), then an optional ttl in
+// seconds and an optional transaction, then the callback
+function writeArgs(first, opts, cb) {
+  var args = first;
+  if (opts.ttl !== undefined) { args.push(opts.ttl); }
+  if (opts.txn) { args.push(opts.txn); }
+  args.push(cb);
+  return args;
+}
+
+// opts.ttl, in seconds, needs a store opened with ttl
+DbStore.prototype.put = function (key, val, opts, cb) {
+  if (typeof opts == 'function') {
+    cb = opts; opts = {};
+  }
+
   var dbstore = this;
-  function put(buf) {
-    return dbstore._put(key, buf, cb);
+  return encode(val, opts, function (err, buf) {
+    if (err) { return cb(err); }
+    return dbstore._put.apply(dbstore, writeArgs([key, buf], opts, cb));
+  });
+};
+
+// Store many [key, value] pairs with a single trip to the worker thread.
+DbStore.prototype.putMany = function (pairs, opts, cb) {
+  if (typeof opts == 'function') {
+    cb = opts; opts = {};
   }
 
-  if (! opts.zlib) {
-    return put(buf);
+  var dbstore = this;
+  var bufs = new Array(pairs.length);
+  var pending = pairs.length, failed = false;
+
+  if (pending === 0) {
+    return process.nextTick(function () { cb(null); });
   }
 
-  var zlib = require('zlib');
-  zlib.deflateRaw(buf, function (err, new_buf) {
+  pairs.forEach(function (pair, i) {
+    encode(pair[1], opts, function (err, buf) {
+      if (failed) { return; }
+      if (err) { failed = true; return cb(err); }
+      bufs[i] = [pair[0], buf];
+      if (--pending === 0) {
+        dbstore._putMany.apply(dbstore, writeArgs([bufs], opts, cb));
+      }
+    });
+  });
+};
+
+// Add a record to a heap, queue or recno store, which chooses its key:
+// cb(err, key) gets a record number, or a Buffer for heap stores.
+DbStore.prototype.append = function (val, opts, cb) {
+  if (typeof opts == 'function') {
+    cb = opts; opts = {};
+  }
+
+  var dbstore = this;
+  return encode(val, opts, function (err, buf) {
     if (err) { return cb(err); }
-    put(new_buf);
+    return dbstore._append.apply(dbstore, writeArgs([buf], opts, cb));
   });
 };
 
+function decode(buf, opts, cb) {
+  function convert(buf) {
+    var err = null;
+    if (opts.encoding || opts.json) {
+      buf = buf.toString(opts.encoding || 'utf8');
+    }
+    if (opts.json) {
+      try {
+        buf = JSON.parse(buf);
+      } catch (x) {
+        err = x;
+      }
+    }
+    cb(err, buf);
+  }
+
+  if (! opts.zlib) {
+    return convert(buf);
+  }
+
+  var zlib = require('zlib');
+  zlib.inflateRaw(buf, function (err, new_buf) {
+    if (err) { return cb(err, buf); }
+    convert(new_buf);
+  });
+}
 
 DbStore.prototype.get = function (key, opts, cb) {
   if (typeof opts == 'function') {
@@ -42,33 +124,254 @@ DbStore.prototype.get = function (key, opts, cb) {
     opts = { encoding: opts };
   }
 
-  return this._get(key, function (err, buf) {
+  function done(err, buf) {
     if (err) { return cb(err, buf); }
+    decode(buf, opts, cb);
+  }
 
-    function decode(buf) {
-      if (opts.encoding || opts.json) {
-        buf = buf.toString(opts.encoding || 'utf8');
-      }
-      if (opts.json) {
-        try {
-          buf = JSON.parse(buf);
-        } catch (x) {
-          err = x;
-        }
+  if (opts.txn) { return this._get(key, opts.txn, done); }
+
+  // Values in the store's valueCache don't need the worker threads
+  var buf = this._cached(key);
+  if (buf !== undefined) {
+    return process.nextTick(function () { done(null, buf); });
+  }
+  return this._get(key, done);
+};
+
+// Look a key up without leaving the JS thread, returning undefined if it
+// is missing.  Only worth it for hot keys whose pages are already cached,
+// a cache miss blocks the event loop on disk.
+DbStore.prototype.getSync = function (key, opts) {
+  if (typeof opts == 'string') {
+    opts = { encoding: opts };
+  }
+  opts = opts || {};
+
+  var buf = this._getSync(key);
+  if (buf === undefined) { return buf; }
+
+  if (opts.zlib) {
+    var zlib = require('zlib');
+    if (! zlib.inflateRawSync) {
+      throw new Error("getSync with zlib requires zlib.inflateRawSync");
+    }
+    buf = zlib.inflateRawSync(buf);
+  }
+
+  var val = buf;
+  decode(buf, { encoding: opts.encoding, json: opts.json }, function (err, v) {
+    if (err) { throw err; }
+    val = v;
+  });
+  return val;
+};
+
+// Look up many keys with a single trip to the worker thread.  Values
+// come back in key order, with undefined for missing keys.
+DbStore.prototype.getMany = function (keys, opts, cb) {
+  if (typeof opts == 'function') {
+    cb = opts; opts = {};
+  } else if (typeof opts == 'string') {
+    opts = { encoding: opts };
+  }
+
+  function done(err, bufs) {
+    if (err) { return cb(err, bufs); }
+
+    var pending = bufs.length, failed = false;
+    if (pending === 0) { return cb(null, bufs); }
+
+    var vals = new Array(bufs.length);
+    function decodeAt(i) {
+      if (bufs[i] === undefined) {
+        if (--pending === 0) { cb(null, vals); }
+        return;
       }
-      cb(err, buf);
+      decode(bufs[i], opts, function (err, val) {
+        if (failed) { return; }
+        if (err) { failed = true; return cb(err, bufs); }
+        vals[i] = val;
+        if (--pending === 0) { cb(null, vals); }
+      });
+    }
+    // bufs is sparse where keys were missing, so don't use forEach
+    for (var i = 0; i < bufs.length; ++i) {
+      decodeAt(i);
     }
+  }
+
+  if (opts.txn) { return this._getMany(keys, opts.txn, done); }
+  return this._getMany(keys, done);
+};
 
-    if (! opts.zlib) {
-      return decode(buf);
+DbStore.prototype.del = function (key, opts, cb) {
+  if (typeof opts == 'function') {
+    cb = opts; opts = {};
+  }
+
+  if (opts.txn) { return this._del(key, opts.txn, cb); }
+  return this._del(key, cb);
+};
+
+// The first key after every key beginning with prefix, if any
+function prefixEnd(prefix) {
+  var buf = Buffer.isBuffer(prefix) ? prefix : new Buffer(prefix, 'utf8');
+  for (var i = buf.length - 1; i >= 0; --i) {
+    if (buf[i] < 0xff) {
+      var end = new Buffer(i + 1);
+      buf.copy(end, 0, 0, i + 1);
+      end[i]++;
+      return end;
     }
+  }
+  return undefined;
+}
 
-    var zlib = require('zlib');
-    zlib.inflateRaw(buf, function (err, new_buf) {
-      if (err) { return cb(err, buf); }
-      decode(new_buf);
+// Iterate over a key range in B-tree order, fetching a page of records
+// per trip to the worker thread.
+//
+// Options: gt, gte, lt, lte, prefix, reverse, limit, bufferSize,
+// keyEncoding ('utf8' by default, or 'buffer') and the usual value
+// decoding options of get.
+function Iterator(dbstore, opts) {
+  opts = opts || {};
+  this.dbstore = dbstore;
+  this.opts = opts;
+  this.keyEncoding = opts.keyEncoding || 'utf8';
+  this.remaining = opts.limit > 0 ? opts.limit : Infinity;
+
+  var lower, lowerInclusive = true, upper, upperInclusive = false;
+  if (opts.prefix !== undefined) {
+    lower = opts.prefix;
+    upper = prefixEnd(opts.prefix);
+  }
+  if (opts.gte !== undefined) { lower = opts.gte; lowerInclusive = true; }
+  if (opts.gt !== undefined) { lower = opts.gt; lowerInclusive = false; }
+  if (opts.lte !== undefined) { upper = opts.lte; upperInclusive = true; }
+  if (opts.lt !== undefined) { upper = opts.lt; upperInclusive = false; }
+
+  this.scan = { reverse: !! opts.reverse, bufferSize: opts.bufferSize };
+  if (opts.reverse) {
+    this.scan.start = upper; this.scan.startExclusive = ! upperInclusive;
+    this.scan.end = lower; this.scan.endInclusive = lowerInclusive;
+  } else {
+    this.scan.start = lower; this.scan.startExclusive = ! lowerInclusive;
+    this.scan.end = upper; this.scan.endInclusive = upperInclusive;
+  }
+
+  this.keys = [];
+  this.values = [];
+  this.done = false;
+  this.ended = false;
+}
+
+// cb(err, key, value); key and value are undefined once the range is done.
+Iterator.prototype.next = function (cb) {
+  var self = this;
+
+  if (this.ended) {
+    return process.nextTick(function () {
+      cb(new Error("iterator has ended"));
+    });
+  }
+
+  if (this.keys.length === 0) {
+    if (this.done || this.remaining <= 0) {
+      return process.nextTick(function () { cb(null); });
+    }
+    if (this.remaining != Infinity) {
+      this.scan.limit = this.remaining;
+    }
+    return this.dbstore._scan(this.scan, function (err, keys, values, done) {
+      if (err) { return cb(err); }
+      self.keys = keys;
+      self.values = values;
+      self.done = done;
+      if (keys.length > 0) {
+        // Resume after the last key seen
+        self.scan.start = keys[keys.length - 1];
+        self.scan.startExclusive = true;
+      }
+      self.next(cb);
+    });
+  }
+
+  this.remaining--;
+  var key = this.keys.shift();
+  var buf = this.values.shift();
+  if (this.keyEncoding != 'buffer') {
+    key = key.toString(this.keyEncoding);
+  }
+  decode(buf, this.opts, function (err, val) {
+    cb(err, key, val);
+  });
+};
+
+Iterator.prototype.end = function (cb) {
+  this.ended = true;
+  this.keys = [];
+  this.values = [];
+  if (cb) { process.nextTick(cb); }
+};
+
+DbStore.Iterator = Iterator;
+
+DbStore.prototype.iterator = function (opts) {
+  return new Iterator(this, opts);
+};
+
+// Records of a store opened with indexes whose key in each index is the
+// one given, [[index, key], ...].  cb(err, records) gets an Array of
+// {key: key, value: value} objects, in primary key order for a single
+// term.  Options: limit, keyEncoding and the value decoding options of get.
+DbStore.prototype.join = function (terms, opts, cb) {
+  if (typeof opts == 'function') {
+    cb = opts; opts = {};
+  } else if (typeof opts == 'string') {
+    opts = { encoding: opts };
+  }
+  var keyEncoding = opts.keyEncoding || 'utf8';
+
+  return this._query(terms, opts.limit || 0, function (err, keys, values) {
+    if (err) { return cb(err); }
+
+    var records = new Array(keys.length), pending = keys.length, failed = false;
+    if (pending === 0) { return cb(null, records); }
+    keys.forEach(function (key, i) {
+      decode(values[i], opts, function (err, val) {
+        if (failed) { return; }
+        if (err) { failed = true; return cb(err); }
+        if (keyEncoding != 'buffer') { key = key.toString(keyEncoding); }
+        records[i] = { key: key, value: val };
+        if (--pending === 0) { cb(null, records); }
+      });
     });
   });
 };
 
+// Records whose key in the named index is key, see join
+DbStore.prototype.query = function (index, key, opts, cb) {
+  return this.join([[index, key]], opts, cb);
+};
+
+// A Readable stream of {key: key, value: value} objects over a key range,
+// takes the same options as iterator.
+DbStore.prototype.createReadStream = function (opts) {
+  var Readable = require('stream').Readable;
+  if (! Readable) {
+    throw new Error("createReadStream requires node >= 0.10");
+  }
+
+  var it = this.iterator(opts);
+  var stream = new Readable({ objectMode: true });
+  stream._read = function () {
+    it.next(function (err, key, value) {
+      if (err) { return stream.emit('error', err); }
+      stream.push(key === undefined ? null : { key: key, value: value });
+    });
+  };
+  return stream;
+};
+
 module.exports = addon.DbStore;
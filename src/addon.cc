@@ -3,12 +3,16 @@
 
 #include "dbstore.h"
 #include "dbenv.h"
+#include "dbtxn.h"
+#include "workpool.h"
 
 using namespace v8;
 
 void InitAll(Handle<Object> exports) {
   DbStore::Init(exports);
   DbEnv::Init(exports);
+  DbTxn::Init(exports);
+  WorkPool::Init(exports);
 }
 
 NODE_MODULE(addon, InitAll)
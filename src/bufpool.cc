@@ -0,0 +1,101 @@
+#include "bufpool.h"
+
+#include <cstdlib>
+
+// Number of classes from MIN_SIZE to MAX_SIZE
+static int const NCLASSES = 15;
+
+// Free slabs kept per class, beyond this they go back to malloc
+static int const MAX_FREE = 256;
+
+struct FreeList {
+  char *slabs[MAX_FREE];
+  int count;
+};
+
+static FreeList freelists[NCLASSES];
+static size_t last_size = 256;
+
+static uv_mutex_t mutex;
+static uv_once_t init_once = UV_ONCE_INIT;
+
+static void
+init_mutex()
+{
+  uv_mutex_init(&mutex);
+}
+
+int
+BufPool::size_class(size_t size)
+{
+  int cls = 0;
+  size_t cap = MIN_SIZE;
+  while (cap < size) {
+    cap <<= 1;
+    ++cls;
+  }
+  return cls;
+}
+
+char *
+BufPool::acquire(size_t size, size_t *capacity)
+{
+  if (size > MAX_SIZE) return NULL;
+  if (size < MIN_SIZE) size = MIN_SIZE;
+
+  int cls = size_class(size);
+  *capacity = MIN_SIZE << cls;
+
+  uv_once(&init_once, init_mutex);
+
+  char *slab = NULL;
+  uv_mutex_lock(&mutex);
+  FreeList &fl = freelists[cls];
+  if (fl.count > 0) {
+    slab = fl.slabs[--fl.count];
+  }
+  uv_mutex_unlock(&mutex);
+
+  if (! slab) {
+    slab = (char *) malloc(*capacity);
+  }
+  return slab;
+}
+
+void
+BufPool::release(char *data, size_t capacity)
+{
+  if (! data) return;
+
+  uv_once(&init_once, init_mutex);
+
+  int cls = size_class(capacity);
+  uv_mutex_lock(&mutex);
+  FreeList &fl = freelists[cls];
+  if (fl.count < MAX_FREE) {
+    fl.slabs[fl.count++] = data;
+    data = NULL;
+  }
+  uv_mutex_unlock(&mutex);
+
+  if (data) free(data);
+}
+
+// The hint is only a guess, so it is deliberately not locked.
+size_t
+BufPool::hint()
+{
+  return last_size;
+}
+
+void
+BufPool::set_hint(size_t size)
+{
+  last_size = size;
+}
+
+void
+BufPool::free_buffer(char *data, void *hint)
+{
+  release(data, (size_t) hint);
+}
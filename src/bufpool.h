@@ -0,0 +1,31 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <node.h>
+
+// A process-wide pool of value buffers in power-of-two size classes.
+// Slabs are taken on worker threads for DB_DBT_USERMEM reads and handed
+// back when the Buffer aliasing them is collected, so steady-state reads
+// don't go through malloc/free at all.
+class BufPool {
+ public:
+  static size_t const MIN_SIZE = 64;
+  static size_t const MAX_SIZE = 1024 * 1024;
+
+  // Returns a slab of at least size bytes and its capacity, or NULL if
+  // size is beyond the largest class.
+  static char *acquire(size_t size, size_t *capacity);
+  static void release(char *data, size_t capacity);
+
+  // A size to try first, based on recent reads
+  static size_t hint();
+  static void set_hint(size_t size);
+
+  // node::Buffer free_callback, hint is the slab capacity
+  static void free_buffer(char *data, void *hint);
+
+ private:
+  static int size_class(size_t size);
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "codec.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <zlib.h>
+
+u_int32_t
+Codec::encode(Type type, u_int32_t threshold,
+              void const *in, u_int32_t len, char *out)
+{
+  if (type == DEFLATE && len >= threshold && len > HEADER) {
+    // Only keep the result if it beats the raw form
+    uLongf clen = len - HEADER;
+    if (compress2((Bytef *) out + HEADER, &clen, (Bytef const *) in, len,
+                  Z_DEFAULT_COMPRESSION) == Z_OK) {
+      out[0] = DEFLATE;
+      memcpy(out + 1, &len, sizeof(len));
+      return HEADER + clen;
+    }
+  }
+
+  out[0] = NONE;
+  memcpy(out + 1, in, len);
+  return 1 + len;
+}
+
+int
+Codec::decoded_length(void const *in, u_int32_t len, u_int32_t *outlen)
+{
+  u_int8_t const *p = (u_int8_t const *) in;
+  if (len < 1) return EINVAL;
+
+  switch (p[0]) {
+  case NONE:
+    *outlen = len - 1;
+    return 0;
+  case DEFLATE:
+    if (len < HEADER) return EINVAL;
+    memcpy(outlen, p + 1, sizeof(*outlen));
+    return 0;
+  default:
+    return EINVAL;
+  }
+}
+
+int
+Codec::decode(void const *in, u_int32_t len, char *out, u_int32_t outlen)
+{
+  u_int8_t const *p = (u_int8_t const *) in;
+  if (p[0] == NONE) {
+    memcpy(out, p + 1, outlen);
+    return 0;
+  }
+
+  uLongf dlen = outlen;
+  int ret = uncompress((Bytef *) out, &dlen, p + HEADER, len - HEADER);
+  if (ret == Z_MEM_ERROR) return ENOMEM;
+  if (ret != Z_OK || dlen != outlen) return EINVAL;
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <db.h>
+
+// Value compression for stores opened with compress.  Every value in such
+// a store starts with a tag byte: raw values follow it as they are,
+// deflated ones follow it with their original length.  Values under the
+// threshold, or that don't shrink, are stored raw.
+class Codec {
+ public:
+  enum Type { NONE = 0, DEFLATE = 1 };
+
+  // Space encode may need for a value of len bytes
+  static u_int32_t bound(u_int32_t len) { return len + HEADER; }
+
+  // Encode len bytes into out, which has room for bound(len), and return
+  // the encoded length
+  static u_int32_t encode(Type type, u_int32_t threshold,
+                          void const *in, u_int32_t len, char *out);
+
+  // Length of the value once decoded.  Returns 0, or EINVAL for a value
+  // without a valid tag.
+  static int decoded_length(void const *in, u_int32_t len, u_int32_t *outlen);
+
+  // Decode into out, which has room for decoded_length.  Returns 0 or an
+  // errno value.
+  static int decode(void const *in, u_int32_t len, char *out, u_int32_t outlen);
+
+  // A raw value is just the payload after the tag
+  static bool is_raw(void const *in, u_int32_t len) {
+    return len > 0 && *(u_int8_t const *) in == NONE;
+  }
+
+ private:
+  static u_int32_t const HEADER = 1 + sizeof(u_int32_t);
+};
+
+#endif
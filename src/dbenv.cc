@@ -1,10 +1,40 @@
 #include <node.h>
+
 #include "dbenv.h"
+#include "dbtxn.h"
+#include "workpool.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
 using namespace v8;
 
-DbEnv::DbEnv() {};
-DbEnv::~DbEnv() {};
+Persistent<FunctionTemplate> DbEnv::constructor_template;
+
+static u_int32_t const GIGA = 1024 * 1024 * 1024;
+
+// Commit callbacks waiting on the next group log flush
+struct FlushWaiter {
+  v8::Persistent<v8::Function> callback;
+  FlushWaiter *next;
+};
+
+DbEnv::DbEnv()
+  : _env(0), _txns(0), _nstores(0), _pending_close(0), _group_commit(0), _flush_timer(0), _waiters(0),
+    _flushing(0),
+    _trickle_timer(0), _trickle_busy(false), _trickle_percent(0),
+    _checkpoint_interval(0), _last_checkpoint(0), _trickle_runs(0),
+    _trickle_pages(0), _trickle_last_pages(0), _checkpoints(0) {};
+DbEnv::~DbEnv() {
+  close();
+  if (_flush_timer) {
+    uv_close((uv_handle_t *)_flush_timer, (uv_close_cb)free);
+  }
+  if (_trickle_timer) {
+    uv_close((uv_handle_t *)_trickle_timer, (uv_close_cb)free);
+  }
+};
 
 void DbEnv::Init(Handle<Object> target) {
   // Prepare constructor template
@@ -12,28 +42,893 @@ void DbEnv::Init(Handle<Object> target) {
   tpl->SetClassName(String::NewSymbol("DbEnv"));
   tpl->InstanceTemplate()->SetInternalFieldCount(1);
   // Prototype
-  tpl->PrototypeTemplate()->Set(String::NewSymbol("plusOne"),
-      FunctionTemplate::New(PlusOne)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("open"),
+      FunctionTemplate::New(Open)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("close"),
+      FunctionTemplate::New(Close)->GetFunction());
+
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("setCacheSize"),
+      FunctionTemplate::New(SetCacheSize)->GetFunction());
+
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("begin"),
+      FunctionTemplate::New(Begin)->GetFunction());
 
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("startTrickle"),
+      FunctionTemplate::New(StartTrickle)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("stopTrickle"),
+      FunctionTemplate::New(StopTrickle)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("trickleStats"),
+      FunctionTemplate::New(TrickleStats)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("stat"),
+      FunctionTemplate::New(Stat)->GetFunction());
+
+  constructor_template = Persistent<FunctionTemplate>::New(tpl);
   Persistent<Function> constructor = Persistent<Function>::New(tpl->GetFunction());
   target->Set(String::NewSymbol("DbEnv"), constructor);
 }
 
+bool DbEnv::HasInstance(Handle<Value> val) {
+  return val->IsObject() && constructor_template->HasInstance(val);
+}
+
+int
+DbEnv::open(char const *home, u_int32_t flags, int mode)
+{
+  return _env->open(_env, home, flags, mode);
+}
+
+int
+DbEnv::close()
+{
+  int ret = 0;
+  if (_env) {
+    ret = _env->close(_env, 0);
+    _env = NULL;
+  }
+  return ret;
+}
+
+void
+DbEnv::add_txn(DbTxn *txn)
+{
+  txn->_env_prev = NULL;
+  txn->_env_next = _txns;
+  if (_txns) _txns->_env_prev = txn;
+  _txns = txn;
+  txn->_listed = true;
+}
+
+void
+DbEnv::remove_txn(DbTxn *txn)
+{
+  if (! txn->_listed) return;
+  if (txn->_env_prev) txn->_env_prev->_env_next = txn->_env_next;
+  else _txns = txn->_env_next;
+  if (txn->_env_next) txn->_env_next->_env_prev = txn->_env_prev;
+  txn->_env_prev = txn->_env_next = NULL;
+  txn->_listed = false;
+}
+
+// Before open this sets the initial cache, afterwards it resizes the
+// running cache (up to the cache max) without reopening.
+int
+DbEnv::set_cachesize(u_int64_t size, int ncache)
+{
+  return _env->set_cachesize(_env, (u_int32_t)(size / GIGA),
+                             (u_int32_t)(size % GIGA), ncache);
+}
+
+int
+DbEnv::set_cache_max(u_int64_t size)
+{
+  return _env->set_cache_max(_env, (u_int32_t)(size / GIGA),
+                             (u_int32_t)(size % GIGA));
+}
+
+int
+DbEnv::txn_begin(DB_TXN **txn, u_int32_t flags)
+{
+  return _env->txn_begin(_env, NULL, txn, flags);
+}
+
 Handle<Value> DbEnv::New(const Arguments& args) {
   HandleScope scope;
 
   DbEnv* obj = new DbEnv();
-  obj->counter_ = args[0]->IsUndefined() ? 0 : args[0]->NumberValue();
   obj->Wrap(args.This());
 
   return args.This();
 }
 
-Handle<Value> DbEnv::PlusOne(const Arguments& args) {
+struct EnvBaton {
+  uv_work_t *req;
+  DbEnv *env;
+
+  char *home;
+  u_int32_t flags;
+  u_int64_t cachesize;
+  u_int64_t cache_max;
+  int ncache;
+  FlushWaiter *waiters;
+  int nwrote;
+  bool checkpoint;
+  DB_MPOOL_STAT *mpool_stat;  // NULL for subsystems the env doesn't have
+  DB_LOCK_STAT *lock_stat;
+  DB_LOG_STAT *log_stat;
+  DB_TXN_STAT *txn_stat;
+  DB_TXN **txns;              // left unfinished, aborted by close
+  u_int32_t ntxns;
+  Persistent<Function> callback;
+
+  char const *call;
+  int ret;
+
+  EnvBaton(uv_work_t *_r, DbEnv *_e);
+  ~EnvBaton();
+};
+
+EnvBaton::EnvBaton(uv_work_t *_r, DbEnv *_e)
+  : req(_r), env(_e), home(0), flags(0), cachesize(0), cache_max(0), ncache(1),
+    waiters(0), nwrote(0), checkpoint(false), mpool_stat(0), lock_stat(0),
+    log_stat(0), txn_stat(0), txns(0), ntxns(0) {
+}
+EnvBaton::~EnvBaton() {
+  WorkPool::free_req(req);
+
+  if (home) free(home);
+  free(mpool_stat);
+  free(lock_stat);
+  free(log_stat);
+  free(txn_stat);
+  free(txns);
+  callback.Dispose();
+}
+
+static void
+EnvAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  EnvBaton *baton = (EnvBaton *)req->data;
+
+  // create an arguments array for the callback
+  Handle<Value> argv[1];
+  if (baton->ret) {
+    argv[0] = node::UVException(0, baton->call, db_strerror(baton->ret));
+  } else {
+    argv[0] = Local<Value>::New(Null());
+  }
+
+  // surround in a try/catch for safety
+  TryCatch try_catch;
+
+  // execute the callback function
+  baton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+  if (try_catch.HasCaught())
+    node::FatalException(try_catch);
+
+  delete baton;
+}
+
+static void
+OpenWork(uv_work_t *req) {
+  EnvBaton *baton = (EnvBaton *) req->data;
+
+  DbEnv *env = baton->env;
+  baton->call = "open";
+
+  // The cache has to be configured before the mpool region exists
+  if (baton->cachesize) {
+    baton->ret = env->set_cachesize(baton->cachesize, baton->ncache);
+    if (baton->ret) return;
+  }
+  if (baton->cache_max) {
+    baton->ret = env->set_cache_max(baton->cache_max);
+    if (baton->ret) return;
+  }
+
+  baton->ret = env->open(baton->home, baton->flags, 0);
+  if (baton->ret) {
+    // A failed DB_ENV->open leaves the handle unusable
+    env->close();
+  }
+}
+
+Handle<Value> DbEnv::Open(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+
+  if (! args[0]->IsString()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be String")));
+    return scope.Close(Undefined());
+  }
+
+  // Options are optional
+  Local<Object> opts = Object::New();
+  int cb_arg = 1;
+  if (args[1]->IsObject() && ! args[1]->IsFunction()) {
+    opts = args[1]->ToObject();
+    cb_arg = 2;
+  }
+
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (obj->_env) {
+    ThrowException(Exception::Error(String::New("DbEnv is already open")));
+    return scope.Close(Undefined());
+  }
+
+  int ret = db_env_create(&obj->_env, 0);
+  if (ret) {
+    obj->_env = NULL;
+    ThrowException(node::UVException(0, "db_env_create", db_strerror(ret)));
+    return scope.Close(Undefined());
+  }
+
+  // Directories, relative to home, that database files can be in, such as
+  // the partitions of a store spread over disks.  New files that don't say
+  // otherwise go in the first.
+  Local<Value> dirs = opts->Get(String::NewSymbol("dataDirs"));
+  if (dirs->IsArray()) {
+    Local<Array> list = Local<Array>::Cast(dirs);
+    for (u_int32_t i = 0; ! ret && i < list->Length(); ++i) {
+      String::Utf8Value dir(list->Get(i));
+      ret = *dir ? obj->_env->add_data_dir(obj->_env, *dir) : EINVAL;
+    }
+    if (ret) {
+      obj->_env->close(obj->_env, 0);
+      obj->_env = NULL;
+      ThrowException(node::UVException(0, "add_data_dir", db_strerror(ret)));
+      return scope.Close(Undefined());
+    }
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  EnvBaton *baton = new EnvBaton(req, obj);
+  req->data = baton;
+
+  String::Utf8Value home(args[0]);
+  baton->home = strdup(*home);
+
+  // A shared, thread-safe buffer pool is all that's needed for caching
+  baton->flags = DB_CREATE | DB_INIT_MPOOL | DB_THREAD;
+  if (opts->Get(String::NewSymbol("private"))->BooleanValue()) {
+    baton->flags |= DB_PRIVATE;
+  }
+
+  bool transactional = opts->Get(String::NewSymbol("transactional"))->BooleanValue();
+  bool concurrent = opts->Get(String::NewSymbol("concurrent"))->BooleanValue();
+  if (transactional && concurrent) {
+    obj->_env->close(obj->_env, 0);
+    obj->_env = NULL;
+    ThrowException(Exception::TypeError(String::New("An environment can't be both transactional and concurrent")));
+    return scope.Close(Undefined());
+  }
+
+  // Concurrent Data Store: many readers and one writer per store at a
+  // time, across every process that opens the environment, without the
+  // cost of logging.  The regions are files in home, so cluster workers
+  // share one cache and see each other's writes.
+  if (concurrent) {
+    baton->flags |= DB_INIT_CDB;
+  }
+
+  // Durable stores need logging, locking and transactions, and recovery
+  // on open in case the last process died mid-write.  With DB_REGISTER
+  // only the first process to open the environment, or the first after
+  // one died holding it, runs recovery, so the others can join safely.
+  if (transactional) {
+    baton->flags |= DB_INIT_TXN | DB_INIT_LOG | DB_INIT_LOCK | DB_RECOVER;
+    if (! (baton->flags & DB_PRIVATE)) {
+      baton->flags |= DB_REGISTER;
+    }
+
+    Local<Value> group = opts->Get(String::NewSymbol("groupCommit"));
+    if (group->IsNumber()) {
+      obj->_group_commit = group->Uint32Value();
+    }
+  }
+
+  Local<Value> cachesize = opts->Get(String::NewSymbol("cacheSize"));
+  if (cachesize->IsNumber()) {
+    baton->cachesize = cachesize->IntegerValue();
+  }
+  Local<Value> cache_max = opts->Get(String::NewSymbol("cacheMax"));
+  if (cache_max->IsNumber()) {
+    baton->cache_max = cache_max->IntegerValue();
+  }
+  Local<Value> ncache = opts->Get(String::NewSymbol("cacheRegions"));
+  if (ncache->IsNumber()) {
+    baton->ncache = ncache->Int32Value();
+  }
+
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  WorkPool::queue(WorkPool::WRITE, req, OpenWork, (uv_after_work_cb)EnvAfter);
+
+  return args.This();
+}
+
+static void
+CloseWork(uv_work_t *req) {
+  EnvBaton *baton = (EnvBaton *) req->data;
+
+  baton->call = "close";
+  baton->ret = 0;
+  for (u_int32_t i = 0; i < baton->ntxns; ++i) {
+    int ret = baton->txns[i]->abort(baton->txns[i]);
+    if (! baton->ret) baton->ret = ret;
+  }
+  int ret = baton->env->close();
+  if (! baton->ret) baton->ret = ret;
+}
+
+Handle<Value> DbEnv::Close(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+
+  if (! args[0]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (obj->_pending_close) {
+    ThrowException(Exception::Error(String::New("DbEnv is already closing")));
+    return scope.Close(Undefined());
+  }
+
+  // Work still running in a transaction would be left using a closed
+  // environment
+  u_int32_t ntxns = 0;
+  for (DbTxn *txn = obj->_txns; txn; txn = txn->_env_next) {
+    if (txn->pending()) {
+      ThrowException(Exception::Error(String::New("DbEnv has transactions still running")));
+      return scope.Close(Undefined());
+    }
+    ++ntxns;
+  }
+
+  // Closing the environment closes every handle opened in it, stores
+  // go first
+  if (obj->_nstores) {
+    ThrowException(Exception::Error(String::New("DbEnv has stores still open")));
+    return scope.Close(Undefined());
+  }
+
+  obj->stop_trickle();
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  EnvBaton *baton = new EnvBaton(req, obj);
+  req->data = baton;
+
+  // Transactions never committed are aborted first, and their handles
+  // forget them so they don't touch the environment once it's gone
+  if (ntxns) {
+    baton->txns = (DB_TXN **) malloc(ntxns * sizeof(DB_TXN *));
+    while (DbTxn *txn = obj->_txns) {
+      baton->txns[baton->ntxns++] = txn->_txn;
+      txn->_txn = NULL;
+      obj->remove_txn(txn);
+    }
+  }
+
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+
+  // Commits waiting on a group commit window are flushed now rather
+  // than when it ends.  That flush and a trickle pass already under way
+  // finish first, the last of them queues the close.
+  obj->_pending_close = baton;
+  if (obj->_waiters) {
+    uv_timer_stop(obj->_flush_timer);
+    obj->flush_now();
+  }
+  obj->maybe_close();
+
+  return args.This();
+}
+
+void
+DbEnv::maybe_close()
+{
+  if (! _pending_close) return;
+  if (_trickle_busy || _flushing || _waiters) return;
+
+  EnvBaton *baton = _pending_close;
+  _pending_close = NULL;
+  WorkPool::queue(WorkPool::WRITE, baton->req, CloseWork, (uv_after_work_cb)EnvAfter);
+}
+
+static void
+SetCacheSizeWork(uv_work_t *req) {
+  EnvBaton *baton = (EnvBaton *) req->data;
+
+  // Resizing walks and moves buffers, keep it off the event loop
+  baton->call = "setCacheSize";
+  baton->ret = baton->env->set_cachesize(baton->cachesize, baton->ncache);
+}
+
+Handle<Value> DbEnv::SetCacheSize(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+
+  if (! args[0]->IsNumber()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a size in bytes")));
+    return scope.Close(Undefined());
+  }
+
+  if (! args[1]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Second argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (! obj->_env) {
+    ThrowException(Exception::Error(String::New("DbEnv is not open")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  EnvBaton *baton = new EnvBaton(req, obj);
+  req->data = baton;
+
+  baton->cachesize = args[0]->IntegerValue();
+  baton->ncache = 0; // ignored once the environment is open
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+
+  WorkPool::queue(WorkPool::WRITE, req, SetCacheSizeWork, (uv_after_work_cb)EnvAfter);
+
+  return args.This();
+}
+
+Handle<Value> DbEnv::Begin(const Arguments& args) {
   HandleScope scope;
 
   DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
-  obj->counter_ += 1;
 
-  return scope.Close(Number::New(obj->counter_));
+  if (! obj->_env) {
+    ThrowException(Exception::Error(String::New("DbEnv is not open")));
+    return scope.Close(Undefined());
+  }
+
+  u_int32_t flags = 0;
+  if (args[0]->IsObject()) {
+    Local<Object> opts = args[0]->ToObject();
+    if (opts->Get(String::NewSymbol("noSync"))->BooleanValue()) {
+      flags |= DB_TXN_NOSYNC;
+    }
+  }
+
+  return scope.Close(DbTxn::NewInstance(args.This(), flags));
+}
+
+// Group commit: commits in a transactional environment with a groupCommit
+// window are written with DB_TXN_NOSYNC, and their callbacks wait here.
+// When the window closes one log flush makes all of them durable.
+
+void
+DbEnv::queue_flush(Persistent<Function> cb)
+{
+  FlushWaiter *waiter = new FlushWaiter;
+  waiter->callback = cb;
+  waiter->next = _waiters;
+
+  if (! _waiters) {
+    // First commit in the window, hold on to the env until it's flushed
+    Ref();
+    if (! _flush_timer) {
+      _flush_timer = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+      uv_timer_init(uv_default_loop(), _flush_timer);
+      _flush_timer->data = this;
+    }
+    uv_timer_start(_flush_timer, FlushTimer, _group_commit, 0);
+  }
+  _waiters = waiter;
+}
+
+static void
+FlushWork(uv_work_t *req) {
+  EnvBaton *baton = (EnvBaton *) req->data;
+
+  baton->call = "commit";
+  DB_ENV *dbenv = baton->env->env();
+  baton->ret = dbenv ? dbenv->log_flush(dbenv, NULL) : EINVAL;
+}
+
+void
+DbEnv::FlushAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  EnvBaton *baton = (EnvBaton *)req->data;
+
+  Handle<Value> argv[1];
+  if (baton->ret) {
+    argv[0] = node::UVException(0, baton->call, db_strerror(baton->ret));
+  } else {
+    argv[0] = Local<Value>::New(Null());
+  }
+
+  FlushWaiter *waiter = baton->waiters;
+  while (waiter) {
+    // surround in a try/catch for safety
+    TryCatch try_catch;
+
+    waiter->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+    if (try_catch.HasCaught())
+      node::FatalException(try_catch);
+
+    FlushWaiter *next = waiter->next;
+    waiter->callback.Dispose();
+    delete waiter;
+    waiter = next;
+  }
+
+  DbEnv *obj = baton->env;
+  obj->_flushing--;
+  obj->maybe_close();
+  obj->Unref();
+  delete baton;
+}
+
+void
+DbEnv::flush_now()
+{
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // Take the whole window's waiters, in commit order.  Later commits
+  // start a new window.
+  EnvBaton *baton = new EnvBaton(req, this);
+  req->data = baton;
+  FlushWaiter *waiter = _waiters;
+  while (waiter) {
+    FlushWaiter *next = waiter->next;
+    waiter->next = baton->waiters;
+    baton->waiters = waiter;
+    waiter = next;
+  }
+  _waiters = NULL;
+  _flushing++;
+
+  WorkPool::queue(WorkPool::WRITE, req, FlushWork, (uv_after_work_cb)FlushAfter);
+}
+
+void
+DbEnv::FlushTimer(uv_timer_t *timer, int status) {
+  DbEnv *obj = (DbEnv *) timer->data;
+  obj->flush_now();
+}
+
+// Background trickle: rather than letting BDB write dirty pages inline
+// when a read needs a free buffer, a timer periodically writes them out
+// from a worker thread until the target percentage of the cache is clean,
+// and checkpoints transactional environments every so often.
+
+Handle<Value> DbEnv::StartTrickle(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+
+  if (! obj->_env) {
+    ThrowException(Exception::Error(String::New("DbEnv is not open")));
+    return scope.Close(Undefined());
+  }
+
+  Local<Object> opts = Object::New();
+  if (args[0]->IsObject()) {
+    opts = args[0]->ToObject();
+  }
+
+  u_int32_t interval = 1000;
+  Local<Value> val = opts->Get(String::NewSymbol("interval"));
+  if (val->IsNumber() && val->Uint32Value() > 0) {
+    interval = val->Uint32Value();
+  }
+
+  obj->_trickle_percent = 20;
+  val = opts->Get(String::NewSymbol("percent"));
+  if (val->IsNumber()) {
+    obj->_trickle_percent = val->Int32Value();
+  }
+  if (obj->_trickle_percent < 1 || obj->_trickle_percent > 100) {
+    ThrowException(Exception::RangeError(String::New("percent must be from 1 to 100")));
+    return scope.Close(Undefined());
+  }
+
+  obj->_checkpoint_interval = 0;
+  val = opts->Get(String::NewSymbol("checkpoint"));
+  if (val->IsNumber()) {
+    obj->_checkpoint_interval = val->IntegerValue();
+  }
+  obj->_last_checkpoint = uv_hrtime();
+
+  if (! obj->_trickle_timer) {
+    obj->_trickle_timer = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+    uv_timer_init(uv_default_loop(), obj->_trickle_timer);
+    obj->_trickle_timer->data = obj;
+    // Background work alone shouldn't keep the process alive
+    uv_unref((uv_handle_t *)obj->_trickle_timer);
+  }
+  uv_timer_start(obj->_trickle_timer, TrickleTimer, interval, interval);
+
+  return args.This();
+}
+
+void
+DbEnv::stop_trickle()
+{
+  if (_trickle_timer) {
+    uv_timer_stop(_trickle_timer);
+  }
+}
+
+Handle<Value> DbEnv::StopTrickle(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+  obj->stop_trickle();
+
+  return args.This();
+}
+
+static void
+TrickleWork(uv_work_t *req) {
+  EnvBaton *baton = (EnvBaton *) req->data;
+
+  // Close waits for this pass, the handle stays good until it's done
+  DB_ENV *dbenv = baton->env->env();
+
+  baton->call = "trickle";
+  baton->ret = dbenv->memp_trickle(dbenv, baton->ncache, &baton->nwrote);
+  if (baton->ret || ! baton->checkpoint) return;
+
+  baton->call = "checkpoint";
+  baton->ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0);
+}
+
+void
+DbEnv::TrickleTimer(uv_timer_t *timer, int status) {
+  DbEnv *obj = (DbEnv *) timer->data;
+
+  // Let a slow pass finish rather than piling up behind it
+  if (obj->_trickle_busy || ! obj->_env) return;
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  EnvBaton *baton = new EnvBaton(req, obj);
+  req->data = baton;
+  baton->ncache = obj->_trickle_percent;
+
+  // Checkpoints only mean something with a log
+  u_int32_t flags = 0;
+  obj->_env->get_open_flags(obj->_env, &flags);
+  u_int64_t now = uv_hrtime();
+  if ((flags & DB_INIT_TXN) && obj->_checkpoint_interval &&
+      now - obj->_last_checkpoint >= obj->_checkpoint_interval * 1000000) {
+    baton->checkpoint = true;
+    obj->_last_checkpoint = now;
+  }
+
+  obj->_trickle_busy = true;
+  obj->Ref();
+
+  WorkPool::queue(WorkPool::WRITE, req, TrickleWork, (uv_after_work_cb)TrickleAfter);
+}
+
+void
+DbEnv::TrickleAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  EnvBaton *baton = (EnvBaton *)req->data;
+  DbEnv *obj = baton->env;
+
+  // There is no one to report errors to, they just show up as a run
+  // that wrote nothing.
+  obj->_trickle_runs++;
+  obj->_trickle_last_pages = baton->ret ? 0 : baton->nwrote;
+  obj->_trickle_pages += obj->_trickle_last_pages;
+  if (baton->checkpoint && ! baton->ret) {
+    obj->_checkpoints++;
+  }
+
+  obj->_trickle_busy = false;
+  obj->maybe_close();
+  obj->Unref();
+  delete baton;
+}
+
+Handle<Value> DbEnv::TrickleStats(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("runs"), Number::New(obj->_trickle_runs));
+  stats->Set(String::NewSymbol("pagesWritten"), Number::New(obj->_trickle_pages));
+  stats->Set(String::NewSymbol("lastPagesWritten"), Integer::NewFromUnsigned(obj->_trickle_last_pages));
+  stats->Set(String::NewSymbol("checkpoints"), Number::New(obj->_checkpoints));
+
+  return scope.Close(stats);
+}
+
+// Statistics of each subsystem the environment was opened with, gathered
+// on a reader thread since the regions have to be locked to read them
+static void
+StatWork(uv_work_t *req) {
+  EnvBaton *baton = (EnvBaton *) req->data;
+
+  DB_ENV *dbenv = baton->env->env();
+  baton->call = "stat";
+  if (! dbenv) {
+    baton->ret = EINVAL;
+    return;
+  }
+
+  u_int32_t flags = 0;
+  baton->ret = dbenv->get_open_flags(dbenv, &flags);
+  if (! baton->ret && (flags & DB_INIT_MPOOL)) {
+    baton->ret = dbenv->memp_stat(dbenv, &baton->mpool_stat, NULL, 0);
+  }
+  if (! baton->ret && (flags & (DB_INIT_LOCK | DB_INIT_CDB))) {
+    baton->ret = dbenv->lock_stat(dbenv, &baton->lock_stat, 0);
+  }
+  if (! baton->ret && (flags & DB_INIT_LOG)) {
+    baton->ret = dbenv->log_stat(dbenv, &baton->log_stat, 0);
+  }
+  if (! baton->ret && (flags & DB_INIT_TXN)) {
+    baton->ret = dbenv->txn_stat(dbenv, &baton->txn_stat, 0);
+  }
+}
+
+static void
+set_count(Local<Object> obj, char const *name, double val)
+{
+  obj->Set(String::NewSymbol(name), Number::New(val));
+}
+
+static Local<Object>
+env_stat_object(EnvBaton *baton)
+{
+  Local<Object> stats = Object::New();
+
+  if (DB_MPOOL_STAT *sp = baton->mpool_stat) {
+    Local<Object> mpool = Object::New();
+    set_count(mpool, "cacheSize", (double) sp->st_gbytes * GIGA + sp->st_bytes);
+    set_count(mpool, "regions", sp->st_ncache);
+    set_count(mpool, "pages", sp->st_pages);
+    set_count(mpool, "hits", sp->st_cache_hit);
+    set_count(mpool, "misses", sp->st_cache_miss);
+    double requests = (double) sp->st_cache_hit + sp->st_cache_miss;
+    set_count(mpool, "hitRatio", requests ? sp->st_cache_hit / requests : 0);
+    set_count(mpool, "pagesCreated", sp->st_page_create);
+    set_count(mpool, "pagesRead", sp->st_page_in);
+    set_count(mpool, "pagesWritten", sp->st_page_out);
+    set_count(mpool, "cleanEvicted", sp->st_ro_evict);
+    set_count(mpool, "dirtyEvicted", sp->st_rw_evict);
+    set_count(mpool, "trickleWritten", sp->st_page_trickle);
+    set_count(mpool, "cleanPages", sp->st_page_clean);
+    set_count(mpool, "dirtyPages", sp->st_page_dirty);
+    set_count(mpool, "hashWaits", sp->st_hash_wait);
+    set_count(mpool, "regionWaits", sp->st_region_wait);
+    set_count(mpool, "ioWaits", sp->st_io_wait);
+    set_count(mpool, "syncInterrupted", sp->st_sync_interrupted);
+    stats->Set(String::NewSymbol("mpool"), mpool);
+  }
+
+  if (DB_LOCK_STAT *sp = baton->lock_stat) {
+    Local<Object> lock = Object::New();
+    set_count(lock, "locks", sp->st_nlocks);
+    set_count(lock, "maxLocks", sp->st_maxnlocks);
+    set_count(lock, "lockers", sp->st_nlockers);
+    set_count(lock, "objects", sp->st_nobjects);
+    set_count(lock, "requests", sp->st_nrequests);
+    set_count(lock, "releases", sp->st_nreleases);
+    set_count(lock, "waits", sp->st_lock_wait);
+    set_count(lock, "noWaits", sp->st_lock_nowait);
+    set_count(lock, "deadlocks", sp->st_ndeadlocks);
+    set_count(lock, "lockTimeouts", sp->st_nlocktimeouts);
+    set_count(lock, "txnTimeouts", sp->st_ntxntimeouts);
+    set_count(lock, "regionWaits", sp->st_region_wait);
+    stats->Set(String::NewSymbol("lock"), lock);
+  }
+
+  if (DB_LOG_STAT *sp = baton->log_stat) {
+    Local<Object> log = Object::New();
+    set_count(log, "bufferSize", sp->st_lg_bsize);
+    set_count(log, "bytesWritten", (double) sp->st_w_mbytes * 1024 * 1024 + sp->st_w_bytes);
+    set_count(log, "records", sp->st_record);
+    set_count(log, "writes", sp->st_wcount);
+    set_count(log, "fullBufferWrites", sp->st_wcount_fill);
+    set_count(log, "syncs", sp->st_scount);
+    set_count(log, "maxCommitsPerFlush", sp->st_maxcommitperflush);
+    set_count(log, "regionWaits", sp->st_region_wait);
+    stats->Set(String::NewSymbol("log"), log);
+  }
+
+  if (DB_TXN_STAT *sp = baton->txn_stat) {
+    Local<Object> txn = Object::New();
+    set_count(txn, "begins", sp->st_nbegins);
+    set_count(txn, "commits", sp->st_ncommits);
+    set_count(txn, "aborts", sp->st_naborts);
+    set_count(txn, "active", sp->st_nactive);
+    set_count(txn, "maxActive", sp->st_maxnactive);
+    set_count(txn, "lastCheckpoint", (double) sp->st_time_ckp);
+    set_count(txn, "regionWaits", sp->st_region_wait);
+    stats->Set(String::NewSymbol("txn"), txn);
+  }
+
+  return stats;
+}
+
+static void
+StatAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  EnvBaton *baton = (EnvBaton *)req->data;
+
+  Handle<Value> argv[2];
+  if (baton->ret) {
+    argv[0] = node::UVException(0, baton->call, db_strerror(baton->ret));
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = env_stat_object(baton);
+  }
+
+  TryCatch try_catch;
+
+  baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+  if (try_catch.HasCaught())
+    node::FatalException(try_catch);
+
+  delete baton;
+}
+
+Handle<Value> DbEnv::Stat(const Arguments& args) {
+  HandleScope scope;
+
+  DbEnv* obj = ObjectWrap::Unwrap<DbEnv>(args.This());
+
+  if (! args[0]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (! obj->_env) {
+    ThrowException(Exception::Error(String::New("DbEnv is not open")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  EnvBaton *baton = new EnvBaton(req, obj);
+  req->data = baton;
+
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+
+  WorkPool::queue(WorkPool::READ, req, StatWork, (uv_after_work_cb)StatAfter);
+
+  return args.This();
 }
@@ -3,17 +3,96 @@
 
 #include <node.h>
 
+#include <db.h>
+
+struct FlushWaiter;
+struct EnvBaton;
+
+class DbTxn;
+
 class DbEnv : public node::ObjectWrap {
  public:
   static void Init(v8::Handle<v8::Object> target);
+  static bool HasInstance(v8::Handle<v8::Value> val);
+
+  int open(char const *home, u_int32_t flags, int mode);
+  int close();
+
+  int set_cachesize(u_int64_t size, int ncache);
+  int set_cache_max(u_int64_t size);
+
+  int txn_begin(DB_TXN **txn, u_int32_t flags);
+
+  // Group commit window in ms, 0 if every commit flushes its own log
+  u_int32_t group_commit() { return _group_commit; }
+  // Call cb once the log has been flushed past the current end
+  void queue_flush(v8::Persistent<v8::Function> cb);
+
+  DB_ENV *env() { return _env; }
+
+  // Transactions begun in the environment and not yet finished, which
+  // close has to deal with before the DB_ENV goes away
+  void add_txn(DbTxn *txn);
+  void remove_txn(DbTxn *txn);
+
+  // Stores opened in the environment and not yet closed, whose handles
+  // DB_ENV->close would close under them
+  void add_store() { ++_nstores; }
+  void remove_store() { --_nstores; }
 
  private:
   DbEnv();
   ~DbEnv();
 
+  DB_ENV *_env;
+  DbTxn *_txns;
+  u_int32_t _nstores;
+  EnvBaton *_pending_close;   // close waiting for background work
+
+  void maybe_close();
+
+  u_int32_t _group_commit;
+  uv_timer_t *_flush_timer;
+  FlushWaiter *_waiters;
+  u_int32_t _flushing;        // log flushes queued and not yet called back
+
+  void flush_now();
+
+  static void FlushTimer(uv_timer_t *timer, int status);
+  static void FlushAfter(uv_work_t *req, int status);
+
+  // Background trickle and checkpoint scheduling
+  uv_timer_t *_trickle_timer;
+  bool _trickle_busy;
+  int _trickle_percent;
+  u_int64_t _checkpoint_interval;   // ms, 0 for none
+  u_int64_t _last_checkpoint;       // uv_hrtime of the last one
+  u_int64_t _trickle_runs;
+  u_int64_t _trickle_pages;
+  u_int32_t _trickle_last_pages;
+  u_int64_t _checkpoints;
+
+  void stop_trickle();
+
+  static void TrickleTimer(uv_timer_t *timer, int status);
+  static void TrickleAfter(uv_work_t *req, int status);
+
+  static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
   static v8::Handle<v8::Value> New(const v8::Arguments& args);
-  static v8::Handle<v8::Value> PlusOne(const v8::Arguments& args);
-  double counter_;
+
+  static v8::Handle<v8::Value> Open(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Close(const v8::Arguments& args);
+
+  static v8::Handle<v8::Value> SetCacheSize(const v8::Arguments& args);
+
+  static v8::Handle<v8::Value> Begin(const v8::Arguments& args);
+
+  static v8::Handle<v8::Value> StartTrickle(const v8::Arguments& args);
+  static v8::Handle<v8::Value> StopTrickle(const v8::Arguments& args);
+  static v8::Handle<v8::Value> TrickleStats(const v8::Arguments& args);
+
+  static v8::Handle<v8::Value> Stat(const v8::Arguments& args);
 };
 
 #endif
@@ -2,16 +2,46 @@
 #include <node_buffer.h>
 
 #include "dbstore.h"
-
+#include "dbenv.h"
+#include "dbtxn.h"
+#include "bufpool.h"
+#include "workpool.h"
+#include "valuecache.h"
+#include "writebuffer.h"
+#include "ttl.h"
+#include "extractor.h"
+
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
 using namespace v8;
 
-DbStore::DbStore() : _db(0), _env(0), _txn(0) {};
+DbStore::DbStore()
+  : _db(0), _expiry(0), _indexes(0), _nindexes(0), _env(0), _type(DB_BTREE), _parts(0),
+    _open(false), _closing(false), _dbenv(0),
+    _cache(0), _codec(Codec::NONE), _codec_threshold(0), _pending_close(0),
+    _compacting(false), _in_flight(0),
+    _wb(0), _wb_timer(0), _wb_max_bytes(0), _wb_held(false),
+    _ttl(false), _sweep_timer(0), _sweep_busy(false), _sweep_batch(0),
+    _sweep_runs(0), _swept(0) {
+  memset(_gets, 0, sizeof(_gets));
+};
 DbStore::~DbStore() {
   //fprintf(stderr, "~DbStore %p\n", this);
   close();
+  free_indexes();
+  detach_env();
+  _env_obj.Dispose();
+  delete _cache;
+  delete _wb;
+  _wb_waiters.Dispose();
+  if (_wb_timer) {
+    uv_close((uv_handle_t *)_wb_timer, (uv_close_cb)free);
+  }
+  if (_sweep_timer) {
+    uv_close((uv_handle_t *)_sweep_timer, (uv_close_cb)free);
+  }
 };
 
 void DbStore::Init(Handle<Object> target) {
@@ -27,37 +57,171 @@ void DbStore::Init(Handle<Object> target) {
 
   tpl->PrototypeTemplate()->Set(String::NewSymbol("_put"),
       FunctionTemplate::New(Put)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_append"),
+      FunctionTemplate::New(Append)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_putMany"),
+      FunctionTemplate::New(PutMany)->GetFunction());
   tpl->PrototypeTemplate()->Set(String::NewSymbol("_get"),
       FunctionTemplate::New(Get)->GetFunction());
-  tpl->PrototypeTemplate()->Set(String::NewSymbol("del"),
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_getSync"),
+      FunctionTemplate::New(GetSync)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_cached"),
+      FunctionTemplate::New(Cached)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("cacheStats"),
+      FunctionTemplate::New(CacheStats)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("stats"),
+      FunctionTemplate::New(Stats)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("stat"),
+      FunctionTemplate::New(Stat)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_getMany"),
+      FunctionTemplate::New(GetMany)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_del"),
       FunctionTemplate::New(Del)->GetFunction());
 
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_scan"),
+      FunctionTemplate::New(Scan)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("_query"),
+      FunctionTemplate::New(Query)->GetFunction());
+
   tpl->PrototypeTemplate()->Set(String::NewSymbol("sync"),
       FunctionTemplate::New(Sync)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("flush"),
+      FunctionTemplate::New(Flush)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("sweepStats"),
+      FunctionTemplate::New(SweepStats)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("compact"),
+      FunctionTemplate::New(Compact)->GetFunction());
 
   Persistent<Function> constructor = Persistent<Function>::New(tpl->GetFunction());
   target->Set(String::NewSymbol("DbStore"), constructor);
 }
 
+// A secondary for the file fname, in fname + suffix: a B-tree with a
+// duplicate, the primary key, per record with that secondary key
+static int
+secondary_open(DB_ENV *env, DB **sdb, char const *fname, char const *suffix,
+               u_int32_t flags, int mode)
+{
+  int ret = db_create(sdb, env, 0);
+  if (ret) return ret;
+  if ((ret = (*sdb)->set_flags(*sdb, DB_DUPSORT))) return ret;
+
+  size_t len = strlen(fname), slen = strlen(suffix);
+  char *name = (char *) malloc(len + slen + 1);
+  memcpy(name, fname, len);
+  memcpy(name + len, suffix, slen + 1);
+  ret = (*sdb)->open(*sdb, NULL, name, NULL, DB_BTREE, flags, mode);
+  free(name);
+  return ret;
+}
+
+static int index_key(DB *sdb, DBT const *key, DBT const *data, DBT *result);
+
+// Which partition a key goes in, for stores partitioned by hash.  This is
+// part of the file format, it must never change.
+static u_int32_t
+partition_hash(DB *db, DBT *key)
+{
+  // FNV-1a
+  u_int32_t h = 2166136261u;
+  u_int8_t const *p = (u_int8_t const *) key->data;
+  for (u_int32_t i = 0; i < key->size; ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
 int
 DbStore::open(char const *fname, char const *db,
-              DBTYPE type, u_int32_t flags, int mode)
+              DbStoreOptions const &opts, u_int32_t flags, int mode)
 {
-  int ret = db_create(&_db, NULL, 0);
+  int ret = db_create(&_db, _env, 0);
   if (ret) return ret;
 
+  // These only take effect when the file is created, an existing
+  // database keeps the settings it was created with.
+  if (opts.pagesize && (ret = _db->set_pagesize(_db, opts.pagesize))) return ret;
+  if (opts.h_ffactor && (ret = _db->set_h_ffactor(_db, opts.h_ffactor))) return ret;
+  if (opts.h_nelem && (ret = _db->set_h_nelem(_db, opts.h_nelem))) return ret;
+  if (opts.q_extentsize && (ret = _db->set_q_extentsize(_db, opts.q_extentsize))) return ret;
+  if (opts.re_len && (ret = _db->set_re_len(_db, opts.re_len))) return ret;
+  if (opts.re_pad >= 0 && (ret = _db->set_re_pad(_db, opts.re_pad))) return ret;
+  // BDB's default compressor: each key and value is stored as the
+  // difference from the one before it on the page
+  if (opts.bt_compress && (ret = _db->set_bt_compress(_db, NULL, NULL))) return ret;
+  // Partitions are files of their own, each with its own pages and locks,
+  // and optionally in directories of their own
+  if (opts.parts) {
+    ret = _db->set_partition(_db, opts.parts, opts.part_keys,
+                             opts.part_keys ? NULL : partition_hash);
+    if (ret) return ret;
+    if (opts.part_dirs && (ret = _db->set_partition_dirs(_db, opts.part_dirs))) return ret;
+    _parts = opts.parts;
+  }
+
+  // In a transactional environment, operations without an explicit
+  // transaction each commit on their own
+  u_int32_t env_flags = 0;
+  if (_env && _env->get_open_flags(_env, &env_flags) == 0 &&
+      (env_flags & DB_INIT_TXN)) {
+    flags |= DB_AUTO_COMMIT;
+  }
+
   //fprintf(stderr, "%p: open %p\n", this, _db);
-  return _db->open(_db, NULL, fname, db, type, flags, mode);
+  ret = _db->open(_db, NULL, fname, db, opts.type, flags, mode);
+  if (ret) return ret;
+
+  // DB_UNKNOWN opens whatever the file already is
+  ret = _db->get_type(_db, &_type);
+  if (ret) return ret;
+
+  // Secondaries are kept up to date by writes through the store, and a
+  // new one is built from the records already there.  Expiry times index
+  // the records of ttl stores by the second they expire.
+  if (opts.ttl) {
+    if ((ret = secondary_open(_env, &_expiry, fname, ".expires", flags, mode))) return ret;
+    if ((ret = _db->associate(_db, NULL, _expiry, Ttl::extract, DB_CREATE))) return ret;
+  }
+
+  for (u_int32_t i = 0; i < _nindexes; ++i) {
+    DbIndex *index = &_indexes[i];
+    size_t len = strlen(index->name);
+    char *suffix = (char *) malloc(len + sizeof("..index"));
+    suffix[0] = '.';
+    memcpy(suffix + 1, index->name, len);
+    memcpy(suffix + 1 + len, ".index", sizeof(".index"));
+    ret = secondary_open(_env, &index->db, fname, suffix, flags, mode);
+    free(suffix);
+    if (ret) return ret;
+
+    index->db->app_private = index;
+    if ((ret = _db->associate(_db, NULL, index->db, index_key, DB_CREATE))) return ret;
+  }
+  return 0;
 }
 
 int
 DbStore::close()
 {
   int ret = 0;
+  if (_expiry) {
+    ret = _expiry->close(_expiry, 0);
+    _expiry = NULL;
+  }
+  for (u_int32_t i = 0; i < _nindexes; ++i) {
+    DB *sdb = _indexes[i].db;
+    if (! sdb) continue;
+    int sret = sdb->close(sdb, 0);
+    if (! ret) ret = sret;
+    _indexes[i].db = NULL;
+  }
   if (_db && _db->pgsize) {
     //fprintf(stderr, "%p: close %p\n", this, _db);
-    ret = _db->close(_db, 0);
+    int pret = _db->close(_db, 0);
+    if (! ret) ret = pret;
     _db = NULL;
+    _parts = 0;
   }
   return ret;
 }
@@ -71,30 +235,516 @@ dbt_set(DBT *dbt, void *data, u_int32_t size, u_int32_t flags = DB_DBT_USERMEM)
   dbt->flags = flags;
 }
 
+// Same ordering as the default B-tree comparison
+static int
+key_cmp(void const *a, u_int32_t alen, void const *b, u_int32_t blen)
+{
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  if (c) return c;
+  return alen < blen ? -1 : (alen > blen ? 1 : 0);
+}
+
+static void
+free_buf(char *data, void *hint)
+{
+  //fprintf(stderr, "Free %p\n", data);
+  free(data);
+}
+
+// Marks a DBT whose data is a slab from the BufPool
+static char pool_tag;
+
+static bool
+dbt_pooled(DBT *dbt)
+{
+  return dbt->app_data == &pool_tag;
+}
+
+// Release whatever memory a returned DBT still owns
+static void
+dbt_free(DBT *dbt)
+{
+  if (! dbt->data) return;
+  if (dbt_pooled(dbt)) {
+    BufPool::release((char *)dbt->data, dbt->ulen);
+  } else if (dbt->flags & DB_DBT_MALLOC) {
+    free(dbt->data);
+  } else {
+    return;
+  }
+  dbt->data = NULL;
+}
+
+// Hand a returned DBT to a Buffer.  Pooled slabs and BDB-malloc'ed
+// memory are aliased, anything else is copied.
+static Handle<Value>
+dbt_to_buffer(DBT *dbt)
+{
+  node::Buffer *buf;
+  if (dbt_pooled(dbt)) {
+    buf = node::Buffer::New((char*)dbt->data, dbt->size,
+                            BufPool::free_buffer, (void *)(size_t)dbt->ulen);
+    dbt->data = NULL; // Now owned by the Buffer
+  } else if (dbt->flags & DB_DBT_MALLOC) {
+    buf = node::Buffer::New((char*)dbt->data, dbt->size, free_buf, NULL);
+    dbt->data = NULL; // Now owned by the Buffer
+  } else {
+    buf = node::Buffer::New((char*)dbt->data, dbt->size);
+  }
+  return buf->handle_;
+}
+
+// Read a value into a pooled slab, starting from the size of recent reads
+// and moving up a size class on DB_BUFFER_SMALL.  Values too big for the
+// largest class fall back to DB_DBT_MALLOC.  On error retbuf owns nothing.
+static int
+pooled_get(DbStore *store, DB_TXN *txn, DBT *key, DBT *retbuf)
+{
+  size_t want = BufPool::hint();
+  for (;;) {
+    size_t capacity;
+    char *slab = BufPool::acquire(want, &capacity);
+    if (! slab) {
+      dbt_set(retbuf, 0, 0, DB_DBT_MALLOC);
+      int ret = store->get(txn, key, retbuf, 0);
+      if (ret) retbuf->data = NULL;
+      return ret;
+    }
+
+    dbt_set(retbuf, slab, 0);
+    retbuf->ulen = capacity;
+    retbuf->app_data = &pool_tag;
+
+    int ret = store->get(txn, key, retbuf, 0);
+    if (ret == 0) {
+      BufPool::set_hint(retbuf->size);
+      return 0;
+    }
+
+    BufPool::release(slab, capacity);
+    retbuf->data = NULL;
+    if (ret != DB_BUFFER_SMALL) return ret;
+    want = retbuf->size;
+  }
+}
+
+// Drop the first skip bytes of a value read into dbt, shifting them down
+// when the memory is ours and just skipping past them when it isn't
+static void
+dbt_skip(DBT *dbt, u_int32_t skip)
+{
+  if (dbt_pooled(dbt) || (dbt->flags & DB_DBT_MALLOC)) {
+    memmove(dbt->data, (char *) dbt->data + skip, dbt->size - skip);
+  } else {
+    dbt->data = (char *) dbt->data + skip;
+  }
+  dbt->size -= skip;
+}
+
+// Undo the store's expiry header and codec on a value read into dbt.  With
+// now, a value that has expired is DB_NOTFOUND, and still owned by dbt.
+// Raw values are shifted down over their tag, deflated ones are inflated
+// into a slab of their own.
+static int
+dbt_decode(DbStore *store, DBT *dbt, u_int32_t now = 0, u_int32_t *expires = NULL)
+{
+  if (expires) *expires = 0;
+  if (! dbt->data) return 0;
+
+  if (store->ttl()) {
+    if (dbt->size < Ttl::HEADER) return EINVAL;
+    u_int32_t when = Ttl::read(dbt->data);
+    if (now && Ttl::expired(when, now)) return DB_NOTFOUND;
+    if (expires) *expires = when;
+    dbt_skip(dbt, Ttl::HEADER);
+  }
+
+  if (store->codec() == Codec::NONE) return 0;
+
+  u_int32_t len;
+  int ret = Codec::decoded_length(dbt->data, dbt->size, &len);
+  if (ret) return ret;
+
+  if (Codec::is_raw(dbt->data, dbt->size)) {
+    dbt_skip(dbt, 1);
+    return 0;
+  }
+
+  size_t capacity;
+  char *out = BufPool::acquire(len, &capacity);
+  DBT decoded;
+  if (out) {
+    dbt_set(&decoded, out, len);
+    decoded.ulen = capacity;
+    decoded.app_data = &pool_tag;
+  } else {
+    out = (char *) malloc(len ? len : 1);
+    dbt_set(&decoded, out, len, DB_DBT_MALLOC);
+  }
+
+  ret = Codec::decode(dbt->data, dbt->size, out, len);
+  if (ret) {
+    dbt_free(&decoded);
+    return ret;
+  }
+  dbt_free(dbt);
+  *dbt = decoded;
+  return 0;
+}
+
+// Apply the store's expiry header and codec to a value about to be
+// written, into a malloc'ed buffer the caller frees.  Returns NULL if the
+// store has neither.
+static char *
+dbt_encode(DbStore *store, DBT *dbt, u_int32_t expires = 0)
+{
+  if (store->codec() == Codec::NONE && ! store->ttl()) return NULL;
+
+  u_int32_t head = store->ttl() ? Ttl::HEADER : 0;
+  char *out;
+  if (store->codec() == Codec::NONE) {
+    out = (char *) malloc(head + dbt->size);
+    memcpy(out + head, dbt->data, dbt->size);
+  } else {
+    out = (char *) malloc(head + Codec::bound(dbt->size));
+    dbt->size = Codec::encode(store->codec(), store->codec_threshold(),
+                              dbt->data, dbt->size, out + head);
+  }
+  if (head) Ttl::write(out, expires);
+  dbt->size += head;
+  dbt->data = out;
+  return out;
+}
+
+// DB->associate callback for the store's indexes.  Runs on whichever
+// worker writes the record, so the value is looked at as the store would
+// return it: past any expiry header, and inflated if need be, in which
+// case the key is copied out for BDB to free.
+static int
+index_key(DB *sdb, DBT const *key, DBT const *data, DBT *result)
+{
+  DbIndex *index = (DbIndex *) sdb->app_private;
+  DbStore *store = index->store;
+
+  char const *value = (char const *) data->data;
+  u_int32_t len = data->size;
+  if (store->ttl()) {
+    if (len < Ttl::HEADER) return DB_DONOTINDEX;
+    value += Ttl::HEADER;
+    len -= Ttl::HEADER;
+  }
+
+  char *inflated = NULL;
+  if (store->codec() != Codec::NONE) {
+    u_int32_t dlen;
+    if (Codec::decoded_length(value, len, &dlen)) return DB_DONOTINDEX;
+    if (Codec::is_raw(value, len)) {
+      value++;
+    } else {
+      inflated = (char *) malloc(dlen ? dlen : 1);
+      if (Codec::decode(value, len, inflated, dlen)) {
+        free(inflated);
+        return DB_DONOTINDEX;
+      }
+      value = inflated;
+    }
+    len = dlen;
+  }
+
+  char const *k;
+  u_int32_t klen;
+  if (! index->extractor->extract(value, len, &k, &klen)) {
+    free(inflated);
+    return DB_DONOTINDEX;
+  }
+
+  memset(result, 0, sizeof(*result));
+  result->size = klen;
+  if (inflated) {
+    result->data = malloc(klen ? klen : 1);
+    memcpy(result->data, k, klen);
+    result->flags = DB_DBT_APPMALLOC;
+    free(inflated);
+  } else {
+    result->data = (void *) k;
+  }
+  return 0;
+}
+
+int
+DbStore::put(DB_TXN *txn, DBT *key, DBT *data, u_int32_t flags)
+{
+  return _db->put(_db, txn, key, data, flags);
+}
+
+int
+DbStore::get(DB_TXN *txn, DBT *key, DBT *data, u_int32_t flags)
+{
+  return _db->get(_db, txn, key, data, flags);
+}
+
 int
-DbStore::put(DBT *key, DBT *data, u_int32_t flags)
+DbStore::del(DB_TXN *txn, DBT *key, u_int32_t flags)
+{
+  return _db->del(_db, txn, key, flags);
+}
+
+u_int32_t
+DbStore::pagesize()
 {
-  return _db->put(_db, 0, key, data, flags);
+  u_int32_t size = 0;
+  if (_db) _db->get_pagesize(_db, &size);
+  return size;
 }
 
 int
-DbStore::get(DBT *key, DBT *data, u_int32_t flags)
+DbStore::cursor(DBC **dbc, u_int32_t flags)
 {
-  return _db->get(_db, 0, key, data, flags);
+  return _db->cursor(_db, 0, dbc, flags);
 }
 
 int
-DbStore::del(DBT *key, u_int32_t flags)
+DbStore::join(DBC **curslist, DBC **dbcp)
+{
+  return _db->join(_db, curslist, dbcp, 0);
+}
+
+DbIndex *
+DbStore::index(char const *name)
+{
+  for (u_int32_t i = 0; i < _nindexes; ++i) {
+    if (! strcmp(_indexes[i].name, name)) return &_indexes[i];
+  }
+  return NULL;
+}
+
+static void
+free_index_list(DbIndex *indexes, u_int32_t count)
+{
+  for (u_int32_t i = 0; i < count; ++i) {
+    free(indexes[i].name);
+    delete indexes[i].extractor;
+  }
+  free(indexes);
+}
+
+void
+DbStore::free_indexes()
 {
-  return _db->del(_db, 0, key, flags);
+  free_index_list(_indexes, _nindexes);
+  _indexes = NULL;
+  _nindexes = 0;
 }
 
 int
 DbStore::sync(u_int32_t flags)
 {
+  return _db->sync(_db, flags);
+}
+
+int
+DbStore::sweep(u_int32_t now, u_int32_t max, u_int32_t *count)
+{
+  *count = 0;
+  if (! _expiry) return 0;
+
+  // Cursor deletes in a transactional environment need a transaction,
+  // and in a concurrent one a write cursor
+  DB_TXN *txn = NULL;
+  u_int32_t env_flags = 0, cursor_flags = 0;
+  int ret;
+  if (_env && _env->get_open_flags(_env, &env_flags) == 0) {
+    if ((env_flags & DB_INIT_TXN) &&
+        (ret = _env->txn_begin(_env, NULL, &txn, 0))) return ret;
+    if (env_flags & DB_INIT_CDB) cursor_flags = DB_WRITECURSOR;
+  }
+
+  DBC *dbc;
+  ret = _expiry->cursor(_expiry, txn, &dbc, cursor_flags);
+  if (! ret) {
+    u_int32_t expires;
+    DBT key, data;
+    memset(&key, 0, sizeof(key));
+    key.data = &expires;
+    key.ulen = sizeof(expires);
+    key.flags = DB_DBT_USERMEM;
+    // Only the position matters, not the record
+    memset(&data, 0, sizeof(data));
+    data.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+
+    while (*count < max) {
+      ret = dbc->get(dbc, &key, &data, DB_NEXT);
+      if (ret) break;
+      if (! Ttl::expired(Ttl::read(&expires), now)) break;
+
+      // Deleting through the index deletes the record itself
+      if ((ret = dbc->del(dbc, 0))) break;
+      ++*count;
+    }
+    if (ret == DB_NOTFOUND) ret = 0;
+
+    int cret = dbc->close(dbc);
+    if (! ret) ret = cret;
+  }
+
+  if (txn) {
+    if (ret) txn->abort(txn);
+    else ret = txn->commit(txn, 0);
+  }
+  return ret;
+}
+
+// Without a transaction, BDB compacts in transactions of its own that
+// commit as it goes, so the tree is never locked for long
+int
+DbStore::compact(DBT *start, DB_COMPACT *c_data, u_int32_t flags, DBT *end)
+{
+  return _db->compact(_db, NULL, start, NULL, c_data, flags, end);
+}
+
+int
+DbStore::stat(void *sp, u_int32_t flags)
+{
+  return _db->stat(_db, NULL, sp, flags);
+}
+
+int
+DbStore::cache_stat(DB_MPOOL_FSTAT *fstat)
+{
+  memset(fstat, 0, sizeof(*fstat));
+
+  char const *fname, *dbname;
+  int ret = _db->get_dbname(_db, &fname, &dbname);
+  if (ret || ! fname) return ret;
+
+  DB_ENV *env = _db->get_env(_db);
+  DB_MPOOL_FSTAT **fsp;
+  ret = env->memp_stat(env, NULL, &fsp, 0);
+  if (ret) return ret;
+  for (DB_MPOOL_FSTAT **f = fsp; f && *f; ++f) {
+    if (! strcmp((*f)->file_name, fname)) {
+      *fstat = **f;
+      fstat->file_name = NULL;
+      break;
+    }
+  }
+  free(fsp);
   return 0;
 }
 
+// Keys may be Strings (stored as UTF-8), Buffers or typed arrays.  Binary
+// keys are used in place, so they may contain NULs and compact fixed-width
+// encodings like big-endian integers.
+static bool
+external_data(Handle<Value> val, char **data, size_t *len)
+{
+  if (node::Buffer::HasInstance(val)) {
+    *data = node::Buffer::Data(val);
+    *len = node::Buffer::Length(val);
+    return true;
+  }
+  if (! val->IsObject()) return false;
+
+  Local<Object> obj = val->ToObject();
+  if (! obj->HasIndexedPropertiesInExternalArrayData()) return false;
+
+  size_t width;
+  switch (obj->GetIndexedPropertiesExternalArrayDataType()) {
+  case kExternalShortArray:
+  case kExternalUnsignedShortArray:
+    width = 2;
+    break;
+  case kExternalIntArray:
+  case kExternalUnsignedIntArray:
+  case kExternalFloatArray:
+    width = 4;
+    break;
+  case kExternalDoubleArray:
+    width = 8;
+    break;
+  default:
+    width = 1;
+  }
+  *data = (char *) obj->GetIndexedPropertiesExternalArrayData();
+  *len = width * obj->GetIndexedPropertiesExternalArrayDataLength();
+  return true;
+}
+
+// Numbers are record numbers for queue and recno stores, stored as a
+// native db_recno_t.
+static bool
+is_key(Handle<Value> val)
+{
+  char *data;
+  size_t len;
+  return val->IsString() || val->IsNumber() || external_data(val, &data, &len);
+}
+
+static size_t
+key_length(Handle<Value> val)
+{
+  char *data;
+  size_t len;
+  if (external_data(val, &data, &len)) return len;
+  if (val->IsNumber()) return sizeof(db_recno_t);
+  return val->ToString()->Utf8Length();
+}
+
+// Copy key_length(val) bytes of the key into dest
+static void
+key_write(Handle<Value> val, char *dest, size_t len)
+{
+  char *data;
+  size_t n;
+  if (external_data(val, &data, &n)) {
+    memcpy(dest, data, len);
+  } else if (val->IsNumber()) {
+    db_recno_t recno = val->Uint32Value();
+    memcpy(dest, &recno, sizeof(recno));
+  } else {
+    val->ToString()->WriteUtf8(dest, len, NULL, String::NO_NULL_TERMINATION);
+  }
+}
+
+// The bytes of a key for the life of this object: binary keys in place,
+// string keys as a malloc'ed UTF-8 copy that may be taken over with steal.
+// Copy a key, such as a scan bound, into malloc'ed memory
+static char *
+bound_copy(Handle<Value> val, u_int32_t *len)
+{
+  *len = key_length(val);
+  char *copy = (char *) malloc(*len ? *len : 1);
+  key_write(val, copy, *len);
+  return copy;
+}
+
+class KeyBytes {
+ public:
+  explicit KeyBytes(Handle<Value> val) : data(0), length(0), _copy(0) {
+    if (! external_data(val, &data, &length)) {
+      length = key_length(val);
+      _copy = data = (char *) malloc(length ? length : 1);
+      key_write(val, data, length);
+    }
+  }
+  ~KeyBytes() {
+    if (_copy) free(_copy);
+  }
+
+  // Take ownership of the copy, NULL if the key was used in place
+  char *steal() {
+    char *copy = _copy;
+    _copy = 0;
+    return copy;
+  }
+
+  char *data;
+  size_t length;
+
+ private:
+  char *_copy;
+};
+
 Handle<Value> DbStore::New(const Arguments& args) {
   HandleScope scope;
 
@@ -107,37 +757,217 @@ Handle<Value> DbStore::New(const Arguments& args) {
 struct WorkBaton {
   uv_work_t *req;
   DbStore *store;
-
-  char *str_arg;
+  DB_TXN *txn;
+
+  char *str_arg;  // file name, or a copy of a string key
+  char *bulk;     // malloc'ed DB_MULTIPLE_KEY buffer owned by the baton
+  DBT *dbts;      // key/data pairs for batched calls, keys point into bulk
+  u_int32_t count;
+  Persistent<Value> txnobj;
+  Persistent<Value> keyobj;
   Persistent<Value> data;
   Persistent<Function> callback;
 
   char const *call;
+  DBT keybuf;
   DBT inbuf;
   DBT retbuf;
   int ret;
 
+  WorkBaton *next_get;  // chain of gets in flight, see DbStore::find_get
+  bool in_flight;
+  u_int32_t cache_version;
+  u_int32_t expires;    // when a put value expires, ttl stores only
+  uv_after_work_cb after;  // run by DbStore::StoreAfter
+
   WorkBaton(uv_work_t *_r, DbStore *_s);
-  ~WorkBaton();
+  virtual ~WorkBaton();
+
+  // Plain batons are made and freed for every operation, recycle them.
+  // Batons are only ever deleted on the loop thread.
+  static void *operator new(size_t size) {
+    if (size == sizeof(WorkBaton)) return Recycler<sizeof(WorkBaton)>::get();
+    return ::operator new(size);
+  }
+  static void operator delete(void *p, size_t size) {
+    if (size == sizeof(WorkBaton)) Recycler<sizeof(WorkBaton)>::put(p);
+    else ::operator delete(p);
+  }
 };
 
 
-WorkBaton::WorkBaton(uv_work_t *_r, DbStore *_s) : req(_r), store(_s), str_arg(0) {
+WorkBaton::WorkBaton(uv_work_t *_r, DbStore *_s) : req(_r), store(_s), txn(0), str_arg(0), bulk(0), dbts(0), count(0), call(0), next_get(0), in_flight(false), cache_version(0), expires(0), after(0) {
+  memset(&retbuf, 0, sizeof(retbuf));
   //fprintf(stderr, "new WorkBaton %p:%p\n", this, req);
 }
 WorkBaton::~WorkBaton() {
   //fprintf(stderr, "~WorkBaton %p:%p\n", this, req);
-  delete req;
+  WorkPool::free_req(req);
 
   if (str_arg) free(str_arg);
+  if (bulk) free(bulk);
+  if (dbts) {
+    // Anything not handed off to a Buffer is still ours
+    for (u_int32_t i = 0; i < 2 * count; ++i) {
+      dbt_free(&dbts[i]);
+    }
+    free(dbts);
+  }
+  dbt_free(&retbuf);
+  txnobj.Dispose();
+  keyobj.Dispose();
   data.Dispose();
   callback.Dispose();
-  // Ignore retbuf since it will be freed by Buffer
+}
+
+WorkBaton *
+DbStore::find_get(void const *key, u_int32_t len)
+{
+  WorkBaton *baton = _gets[ValueCache::hash(key, len) % GET_BUCKETS];
+  for (; baton; baton = baton->next_get) {
+    if (baton->keybuf.size == len && ! memcmp(baton->keybuf.data, key, len)) {
+      return baton;
+    }
+  }
+  return NULL;
+}
+
+void
+DbStore::add_get(WorkBaton *baton)
+{
+  WorkBaton **head = &_gets[ValueCache::hash(baton->keybuf.data, baton->keybuf.size) % GET_BUCKETS];
+  baton->next_get = *head;
+  baton->in_flight = true;
+  *head = baton;
+}
+
+// Later gets of the key must not join a lookup that may have started
+// before a write to it.  The forgotten get still completes.
+void
+DbStore::forget_get(void const *key, u_int32_t len)
+{
+  WorkBaton **link = &_gets[ValueCache::hash(key, len) % GET_BUCKETS];
+  for (; *link; link = &(*link)->next_get) {
+    WorkBaton *baton = *link;
+    if (baton->keybuf.size == len && ! memcmp(baton->keybuf.data, key, len)) {
+      *link = baton->next_get;
+      baton->in_flight = false;
+      return;
+    }
+  }
+}
+
+void
+DbStore::invalidate(void const *key, u_int32_t len)
+{
+  forget_get(key, len);
+  if (_cache) _cache->invalidate(key, len);
+}
+
+void
+DbStore::forget_gets()
+{
+  for (int i = 0; i < GET_BUCKETS; ++i) {
+    for (WorkBaton *baton = _gets[i]; baton; baton = baton->next_get) {
+      baton->in_flight = false;
+    }
+    _gets[i] = NULL;
+  }
+}
+
+// Point the baton's keybuf at the key.  Binary keys are pinned for the
+// duration of the work instead of being copied.
+static void
+baton_key(WorkBaton *baton, Handle<Value> key)
+{
+  KeyBytes bytes(key);
+  dbt_set(&baton->keybuf, bytes.data, bytes.length);
+  baton->str_arg = bytes.steal();
+  if (! baton->str_arg) {
+    baton->keyobj = Persistent<Value>::New(key);
+  }
+}
+
+// An optional DbTxn may come just before the callback at args[i].
+// Returns the index of the callback, or -1 having thrown for a
+// transaction that has already finished.
+static int
+txn_arg(const Arguments& args, int i, DB_TXN **txn)
+{
+  *txn = NULL;
+  if (! DbTxn::HasInstance(args[i])) return i;
+
+  *txn = node::ObjectWrap::Unwrap<DbTxn>(args[i]->ToObject())->txn();
+  if (! *txn) {
+    ThrowException(Exception::Error(String::New("Transaction has already finished")));
+    return -1;
+  }
+  return i + 1;
+}
+
+// An optional ttl in seconds may come at args[i], only for ttl stores.
+// Returns the index of what follows it, or -1 having thrown.
+static int
+ttl_arg(const Arguments& args, int i, DbStore *store, u_int32_t *expires)
+{
+  *expires = 0;
+  if (! args[i]->IsNumber()) return i;
+
+  if (! store->ttl()) {
+    ThrowException(Exception::Error(String::New("Store was not opened with ttl")));
+    return -1;
+  }
+  *expires = Ttl::expires(args[i]->Uint32Value());
+  return i + 1;
+}
+
+static void
+baton_txn(WorkBaton *baton, DB_TXN *txn, Handle<Value> txnobj)
+{
+  baton->txn = txn;
+  if (txn) {
+    baton->txnobj = Persistent<Value>::New(txnobj); // Pin until complete
+  }
+}
+
+// Queue the baton's work, behind whatever else its transaction has
+// queued if it has one.  The store counts it until after has run, so a
+// close can't pull the DB handle out from under it.
+void
+DbStore::queue(WorkPool::Queue q, WorkBaton *baton, uv_work_cb work, uv_after_work_cb after)
+{
+  baton->after = after;
+  if (_in_flight++ == 0) Ref();
+
+  if (baton->txn) {
+    DbTxn *txn = node::ObjectWrap::Unwrap<DbTxn>(baton->txnobj->ToObject());
+    txn->queue(q, baton->req, work, StoreAfter);
+  } else {
+    WorkPool::queue(q, baton->req, work, StoreAfter);
+  }
+}
+
+void
+DbStore::StoreAfter(uv_work_t *req, int status)
+{
+  WorkBaton *baton = (WorkBaton *) req->data;
+  DbStore *store = baton->store;
+
+  // The baton is gone once its own after has run
+  baton->after(req, status);
+
+  if (--store->_in_flight == 0) {
+    store->maybe_close();
+    store->Unref();
+  }
 }
 
 static void
 After(WorkBaton *baton, Handle<Value> *argv, int argc)
 {
+  WorkPool::Timing const &t = WorkPool::timing();
+  baton->store->op_stats().record(baton->call, t.queued, t.started, t.finished, uv_hrtime());
+
   if (baton->ret) {
     //fprintf(stderr, "%s %s error %d\n", baton->call, baton->str_arg, baton->ret);
     argv[0] = node::UVException(0, baton->call, db_strerror(baton->ret));
@@ -158,22 +988,68 @@ After(WorkBaton *baton, Handle<Value> *argv, int argc)
   delete baton;
 }
 
+struct OpenBaton : public WorkBaton {
+  DbStoreOptions opts;
+
+  OpenBaton(uv_work_t *_r, DbStore *_s) : WorkBaton(_r, _s) {}
+  ~OpenBaton();
+};
+
+// BDB takes copies of the partition keys and directories
+OpenBaton::~OpenBaton() {
+  for (u_int32_t i = 0; opts.part_keys && i + 1 < opts.parts; ++i) {
+    free(opts.part_keys[i].data);
+  }
+  free(opts.part_keys);
+  for (char const **dir = opts.part_dirs; dir && *dir; ++dir) {
+    free((void *) *dir);
+  }
+  free(opts.part_dirs);
+}
+
 void
 OpenWork(uv_work_t *req) {
-  WorkBaton *baton = (WorkBaton *) req->data;
+  OpenBaton *baton = (OpenBaton *) req->data;
 
   DbStore *store = baton->store;
   baton->call = "open";
-  baton->ret = store->open(baton->str_arg, NULL, DB_BTREE, DB_CREATE|DB_THREAD, 0);
+  baton->ret = store->open(baton->str_arg, NULL, baton->opts, DB_CREATE|DB_THREAD, 0);
+}
+
+static bool
+type_arg(Handle<Value> val, DBTYPE *type)
+{
+  if (val->IsUndefined()) return true;
+
+  String::Utf8Value name(val);
+  if (! *name) return false;
+  if (! strcmp(*name, "btree")) *type = DB_BTREE;
+  else if (! strcmp(*name, "hash")) *type = DB_HASH;
+  else if (! strcmp(*name, "heap")) *type = DB_HEAP;
+  else if (! strcmp(*name, "queue")) *type = DB_QUEUE;
+  else if (! strcmp(*name, "recno")) *type = DB_RECNO;
+  else if (! strcmp(*name, "any")) *type = DB_UNKNOWN;
+  else return false;
+  return true;
+}
+
+static u_int32_t
+uint_opt(Handle<Object> opts, char const *name)
+{
+  Local<Value> val = opts->Get(String::NewSymbol(name));
+  return val->IsNumber() ? val->Uint32Value() : 0;
 }
 
 void
-OpenAfter(uv_work_t *req, int status) {
+DbStore::OpenAfter(uv_work_t *req, int status) {
   HandleScope scope;
 
   // fetch our data structure
   WorkBaton *baton = (WorkBaton *)req->data;
 
+  // The sync paths check this rather than the handles the workers set
+  baton->store->_open = ! baton->ret;
+
   // create an arguments array for the callback
   Handle<Value> argv[1];
 
@@ -190,23 +1066,260 @@ Handle<Value> DbStore::Open(const Arguments& args) {
     return scope.Close(Undefined());
   }
 
-  if (! args[1]->IsFunction()) {
-    ThrowException(Exception::TypeError(String::New("Second argument must be callback function")));
+  // Options are optional
+  Local<Object> opts = Object::New();
+  int cb_arg = 1;
+  if (args[1]->IsObject() && ! args[1]->IsFunction()) {
+    opts = args[1]->ToObject();
+    cb_arg = 2;
+  }
+
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  // Every option is parsed and checked before the store is touched, so
+  // a bad one leaves it as it was
+
+  // Attach to a shared environment, file names are then relative to its
+  // home and the store uses its buffer pool.  The environment must stay
+  // open until the store is closed.
+  Local<Value> env = opts->Get(String::NewSymbol("env"));
+  DbEnv *dbenv = NULL;
+  if (! env->IsUndefined()) {
+    if (! DbEnv::HasInstance(env)) {
+      ThrowException(Exception::TypeError(String::New("env option must be a DbEnv")));
+      return scope.Close(Undefined());
+    }
+    dbenv = ObjectWrap::Unwrap<DbEnv>(env->ToObject());
+    if (! dbenv->env()) {
+      ThrowException(Exception::Error(String::New("DbEnv is not open")));
+      return scope.Close(Undefined());
+    }
+  }
+
+  DbStoreOptions dbopts;
+  if (! type_arg(opts->Get(String::NewSymbol("type")), &dbopts.type)) {
+    ThrowException(Exception::TypeError(String::New("type must be btree, hash, heap, queue, recno or any")));
+    return scope.Close(Undefined());
+  }
+  dbopts.pagesize = uint_opt(opts, "pageSize");
+  dbopts.h_ffactor = uint_opt(opts, "hashFillFactor");
+  dbopts.h_nelem = uint_opt(opts, "nelem");
+  dbopts.q_extentsize = uint_opt(opts, "extentSize");
+  dbopts.re_len = uint_opt(opts, "recordLength");
+  Local<Value> pad = opts->Get(String::NewSymbol("recordPad"));
+  if (pad->IsNumber()) {
+    dbopts.re_pad = pad->Uint32Value() & 0xff;
+  }
+  dbopts.bt_compress = opts->Get(String::NewSymbol("btreeCompress"))->BooleanValue();
+  if (dbopts.bt_compress && dbopts.type != DB_BTREE) {
+    ThrowException(Exception::TypeError(String::New("btreeCompress needs a btree store")));
+    return scope.Close(Undefined());
+  }
+  if (dbopts.type == DB_QUEUE && ! dbopts.re_len) {
+    ThrowException(Exception::TypeError(String::New("queue stores need a recordLength")));
+    return scope.Close(Undefined());
+  }
+
+  // Values are compressed on the worker threads.  Only deflate is built
+  // in, node carries zlib for us.
+  Local<Value> compress = opts->Get(String::NewSymbol("compress"));
+  Codec::Type codec = Codec::NONE;
+  if (! compress->IsUndefined() && ! compress->IsFalse()) {
+    String::Utf8Value name(compress);
+    if (! *name || strcmp(*name, "deflate")) {
+      ThrowException(Exception::TypeError(String::New("compress must be 'deflate'")));
+      return scope.Close(Undefined());
+    }
+    codec = Codec::DEFLATE;
+  }
+  u_int32_t codec_threshold = 128;
+  Local<Value> threshold = opts->Get(String::NewSymbol("compressThreshold"));
+  if (threshold->IsNumber()) {
+    codec_threshold = threshold->Uint32Value();
+  }
+
+  // Hold puts and dels back and write them in sorted batches
+  Local<Value> wb = opts->Get(String::NewSymbol("writeBehind"));
+  if (obj->_wb && (! obj->_wb->empty() || obj->_wb->flushing())) {
+    ThrowException(Exception::Error(String::New("Buffered writes must be flushed before reopening")));
+    return scope.Close(Undefined());
+  }
+  bool write_behind = wb->IsObject() || wb->IsTrue();
+  u_int32_t wb_interval = 0, wb_max_bytes = 0;
+  if (write_behind) {
+    Local<Object> wbopts = wb->IsObject() ? wb->ToObject() : Object::New();
+    wb_interval = uint_opt(wbopts, "interval");
+    if (! wb_interval) wb_interval = 100;
+    wb_max_bytes = uint_opt(wbopts, "maxBytes");
+    if (! wb_max_bytes) wb_max_bytes = 4 * 1024 * 1024;
+  }
+
+  // Values may be put with a ttl in seconds, expired records are swept
+  // every sweepInterval ms, up to sweepBatch at a time
+  Local<Value> ttl = opts->Get(String::NewSymbol("ttl"));
+  dbopts.ttl = ttl->IsObject() || ttl->IsTrue();
+  u_int32_t sweep_interval = 0, sweep_batch = 0;
+  if (dbopts.ttl) {
+    Local<Object> ttlopts = ttl->IsObject() ? ttl->ToObject() : Object::New();
+    sweep_interval = uint_opt(ttlopts, "sweepInterval");
+    if (! sweep_interval) sweep_interval = 1000;
+    sweep_batch = uint_opt(ttlopts, "sweepBatch");
+    if (! sweep_batch) sweep_batch = 1000;
+  }
+
+  // An LRU of up to this many bytes of values in front of the store
+  Local<Value> cache_bytes = opts->Get(String::NewSymbol("valueCache"));
+  int64_t cache_size = 0;
+  if (cache_bytes->IsNumber() && cache_bytes->IntegerValue() > 0) {
+    cache_size = cache_bytes->IntegerValue();
+  }
+
+  // Spread the records over several files: by key range, given the
+  // lowest key of every partition but the first, or by a hash of the key
+  Local<Value> partition = opts->Get(String::NewSymbol("partition"));
+  Local<Array> part_keys, part_dirs;
+  if (partition->IsObject()) {
+    if (dbopts.type != DB_BTREE && dbopts.type != DB_HASH) {
+      ThrowException(Exception::TypeError(String::New("partition needs a btree or hash store")));
+      return scope.Close(Undefined());
+    }
+    Local<Object> popts = partition->ToObject();
+    Local<Value> keys = popts->Get(String::NewSymbol("keys"));
+    dbopts.parts = uint_opt(popts, "count");
+    if (keys->IsArray()) {
+      part_keys = Local<Array>::Cast(keys);
+      dbopts.parts = part_keys->Length() + 1;
+      bool sorted = dbopts.type == DB_BTREE;
+      for (u_int32_t i = 0; sorted && i < part_keys->Length(); ++i) {
+        if (! is_key(part_keys->Get(i))) {
+          sorted = false;
+        } else if (i > 0) {
+          KeyBytes a(part_keys->Get(i - 1)), b(part_keys->Get(i));
+          sorted = key_cmp(a.data, a.length, b.data, b.length) < 0;
+        }
+      }
+      if (! sorted) {
+        ThrowException(Exception::TypeError(String::New("partition keys must be ascending keys of a btree store")));
+        return scope.Close(Undefined());
+      }
+    }
+    if (dbopts.parts < 2) {
+      ThrowException(Exception::TypeError(String::New("partition needs keys or a count of at least 2")));
+      return scope.Close(Undefined());
+    }
+    Local<Value> dirs = popts->Get(String::NewSymbol("dirs"));
+    if (dirs->IsArray()) {
+      part_dirs = Local<Array>::Cast(dirs);
+    }
+  }
+
+  // Secondary indexes by name, each keyed by what its extractor finds in
+  // the values.  Built last, the only option that allocates.
+  Local<Value> indexes = opts->Get(String::NewSymbol("indexes"));
+  if (obj->_nindexes && obj->_db) {
+    ThrowException(Exception::Error(String::New("Close the store before reopening it")));
     return scope.Close(Undefined());
   }
+  DbIndex *index_list = NULL;
+  u_int32_t nindexes = 0;
+  if (indexes->IsObject()) {
+    Local<Object> specs = indexes->ToObject();
+    Local<Array> names = specs->GetOwnPropertyNames();
+    index_list = (DbIndex *) calloc(names->Length() ? names->Length() : 1, sizeof(DbIndex));
+    for (u_int32_t i = 0; i < names->Length(); ++i) {
+      String::Utf8Value name(names->Get(i));
+      Local<Value> spec = specs->Get(names->Get(i));
+      Extractor *extractor = spec->IsObject() ? Extractor::New(spec->ToObject()) : NULL;
+      if (! extractor || ! name.length() || strchr(*name, '/')) {
+        delete extractor;
+        free_index_list(index_list, nindexes);
+        ThrowException(Exception::TypeError(String::New("indexes must map names to {offset, length}, {field, delimiter} or {path}")));
+        return scope.Close(Undefined());
+      }
+      DbIndex *index = &index_list[nindexes++];
+      index->name = strdup(*name);
+      index->extractor = extractor;
+      index->store = obj;
+    }
+  }
+
+  // All good, now set the store up
+  if (dbenv) {
+    obj->detach_env();
+    dbenv->add_store();
+    obj->_dbenv = dbenv;
+    obj->_env = dbenv->env();
+    obj->_env_obj.Dispose();
+    obj->_env_obj = Persistent<Object>::New(env->ToObject());
+  }
+
+  obj->_codec = codec;
+  obj->_codec_threshold = codec_threshold;
+
+  obj->stop_buffer();
+  if (write_behind) {
+    obj->_wb_max_bytes = wb_max_bytes;
+    obj->_wb = new WriteBuffer();
+    if (! obj->_wb_timer) {
+      obj->_wb_timer = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+      uv_timer_init(uv_default_loop(), obj->_wb_timer);
+      obj->_wb_timer->data = obj;
+    }
+    uv_timer_start(obj->_wb_timer, BufferTimer, wb_interval, wb_interval);
+    uv_unref((uv_handle_t *)obj->_wb_timer);
+  }
+
+  obj->stop_sweep();
+  obj->_ttl = dbopts.ttl;
+  if (obj->_ttl) {
+    obj->_sweep_batch = sweep_batch;
+    if (! obj->_sweep_timer) {
+      obj->_sweep_timer = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+      uv_timer_init(uv_default_loop(), obj->_sweep_timer);
+      obj->_sweep_timer->data = obj;
+    }
+    uv_timer_start(obj->_sweep_timer, SweepTimer, sweep_interval, sweep_interval);
+    uv_unref((uv_handle_t *)obj->_sweep_timer);
+  }
+
+  delete obj->_cache;
+  obj->_cache = cache_size ? new ValueCache(cache_size) : NULL;
+
+  obj->free_indexes();
+  obj->_indexes = index_list;
+  obj->_nindexes = nindexes;
 
   // create an async work token
-  uv_work_t *req = new uv_work_t;
+  uv_work_t *req = WorkPool::new_req();
 
   // assign our data structure that will be passed around
-  WorkBaton *baton = new WorkBaton(req, obj);
+  OpenBaton *baton = new OpenBaton(req, obj);
   req->data = baton;
+  baton->opts = dbopts;
+  if (! part_keys.IsEmpty()) {
+    baton->opts.part_keys = (DBT *) calloc(dbopts.parts - 1, sizeof(DBT));
+    for (u_int32_t i = 0; i + 1 < dbopts.parts; ++i) {
+      u_int32_t len;
+      char *data = bound_copy(part_keys->Get(i), &len);
+      dbt_set(&baton->opts.part_keys[i], data, len, 0);
+    }
+  }
+  if (! part_dirs.IsEmpty() && part_dirs->Length()) {
+    baton->opts.part_dirs = (char const **) calloc(part_dirs->Length() + 1, sizeof(char *));
+    for (u_int32_t i = 0; i < part_dirs->Length(); ++i) {
+      String::Utf8Value dir(part_dirs->Get(i));
+      baton->opts.part_dirs[i] = strdup(*dir ? *dir : "");
+    }
+  }
 
   String::Utf8Value fname(args[0]);
   baton->str_arg = strdup(*fname);
-  baton->callback = Persistent<Function>::New(Handle<Function>::Cast(args[1]));
+  baton->callback = Persistent<Function>::New(Handle<Function>::Cast(args[cb_arg]));
 
-  uv_queue_work(uv_default_loop(), req, OpenWork, (uv_after_work_cb)OpenAfter);
+  obj->queue(WorkPool::WRITE, baton, OpenWork, (uv_after_work_cb)OpenAfter);
 
   return args.This();
 }
@@ -220,8 +1333,26 @@ CloseWork(uv_work_t *req) {
   baton->ret = store->close();
 }
 
+void
+DbStore::CloseAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  WorkBaton *baton = (WorkBaton *)req->data;
+
+  // Its handles are gone, the environment may close now
+  baton->store->detach_env();
+  baton->store->_closing = false;
+
+  // create an arguments array for the callback
+  Handle<Value> argv[1];
+  After(baton, argv, 1);
+}
+
+// A close that failed before it got to the handles, the store stays
+// open in its environment
 static void
-CloseAfter(uv_work_t *req, int status) {
+CloseFailedAfter(uv_work_t *req, int status) {
   HandleScope scope;
 
   // fetch our data structure
@@ -242,20 +1373,56 @@ Handle<Value> DbStore::Close(const Arguments& args) {
     return scope.Close(Undefined());
   }
 
+  if (obj->_closing) {
+    ThrowException(Exception::Error(String::New("DbStore is already closing")));
+    return scope.Close(Undefined());
+  }
+
   // create an async work token
-  uv_work_t *req = new uv_work_t;
+  uv_work_t *req = WorkPool::new_req();
 
   // assign our data structure that will be passed around
   WorkBaton *baton = new WorkBaton(req, obj);
   req->data = baton;
 
   baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
-
-  uv_queue_work(uv_default_loop(), req, CloseWork, (uv_after_work_cb)CloseAfter);
+  obj->_open = false;
+  obj->_closing = true;
+  if (obj->_cache) obj->_cache->clear();
+
+  // Buffered writes go out and reads, writes, a sweep or a compaction
+  // slice under way finish first, the last of them queues the close
+  obj->_pending_close = baton;
+  obj->stop_sweep();
+  if (obj->_wb && ! obj->_wb->empty() && ! obj->_wb->flushing()) {
+    obj->flush_buffer();
+  }
+  obj->maybe_close();
 
   return args.This();
 }
 
+void
+DbStore::detach_env()
+{
+  if (! _dbenv) return;
+  _dbenv->remove_store();
+  _dbenv = NULL;
+}
+
+void
+DbStore::maybe_close()
+{
+  if (! _pending_close) return;
+  if (_wb && (! _wb->empty() || _wb->flushing())) return;
+  if (_sweep_busy || _compacting || _in_flight) return;
+
+  WorkBaton *baton = _pending_close;
+  _pending_close = NULL;
+  stop_buffer();
+  WorkPool::queue(WorkPool::WRITE, baton->req, CloseWork, (uv_after_work_cb)CloseAfter);
+}
+
 static void
 PutWork(uv_work_t *req) {
   WorkBaton *baton = (WorkBaton *) req->data;
@@ -263,13 +1430,12 @@ PutWork(uv_work_t *req) {
 
   DbStore *store = baton->store;
 
-  DBT key_dbt;
-  dbt_set(&key_dbt, baton->str_arg, strlen(baton->str_arg));
   DBT &data_dbt = baton->inbuf;
+  baton->bulk = dbt_encode(store, &data_dbt, baton->expires);
 
   baton->call = "put";
-  //fprintf(stderr, "put %s %p[%d]\n", baton->str_arg, data_dbt.data, data_dbt.size);
-  baton->ret = store->put(&key_dbt, &data_dbt, 0);
+  //fprintf(stderr, "put %p[%d]\n", data_dbt.data, data_dbt.size);
+  baton->ret = store->put(baton->txn, &baton->keybuf, &data_dbt, 0);
 }
 
 static void
@@ -285,38 +1451,76 @@ PutAfter(uv_work_t *req, int status) {
   After(baton, argv, 1);
 }
 
+// Completion of a put or del of the key in keybuf
+static void
+WriteAfter(uv_work_t *req, int status) {
+  WorkBaton *baton = (WorkBaton *)req->data;
+  baton->store->invalidate(baton->keybuf.data, baton->keybuf.size);
+  PutAfter(req, status);
+}
+
 Handle<Value> DbStore::Put(const Arguments& args) {
   HandleScope scope;
 
   DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
 
-  if (! args.Length() > 0 && ! args[0]->IsString()) {
-     ThrowException(Exception::TypeError(String::New("First argument must be a string")));
+  if (! is_key(args[0])) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a String or Buffer key")));
     return scope.Close(Undefined());
   }
-  String::Utf8Value key(args[0]);
 
-  if (! args.Length() > 1 && ! node::Buffer::HasInstance(args[1])) {
-     ThrowException(Exception::TypeError(String::New("Second argument must be a Buffer")));
+  if (! node::Buffer::HasInstance(args[1])) {
+    ThrowException(Exception::TypeError(String::New("Second argument must be a Buffer")));
     return scope.Close(Undefined());
   }
   Handle<Object> buf = args[1]->ToObject();
 
-  if (! args.Length() > 2 && ! args[2]->IsFunction()) {
+  u_int32_t expires;
+  int txn_at = ttl_arg(args, 2, obj, &expires);
+  if (txn_at < 0) return scope.Close(Undefined());
+
+  DB_TXN *txn;
+  int cb_arg = txn_arg(args, txn_at, &txn);
+  if (cb_arg < 0) return scope.Close(Undefined());
+
+  if (! args[cb_arg]->IsFunction()) {
     ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
     return scope.Close(Undefined());
   }
-  Handle<Function> cb = Handle<Function>::Cast(args[2]);
+  Handle<Function> cb = Handle<Function>::Cast(args[cb_arg]);
+
+  if (obj->_wb && txn) {
+    ThrowException(Exception::Error(String::New("Write-behind stores don't take transactions")));
+    return scope.Close(Undefined());
+  }
 
   // create an async work token
-  uv_work_t *req = new uv_work_t;
+  uv_work_t *req = WorkPool::new_req();
 
   // assign our data structure that will be passed around
   WorkBaton *baton = new WorkBaton(req, obj);
   //fprintf(stderr, "DbStore::Put %p baton %p\n", req, baton);
   req->data = baton;
 
-  baton->str_arg = strdup(*key);
+  baton_key(baton, args[0]);
+  baton_txn(baton, txn, args[txn_at]);
+  baton->expires = expires;
+  obj->invalidate(baton->keybuf.data, baton->keybuf.size);
+
+  if (obj->_wb) {
+    // Buffered values are kept as stored, expiry header first
+    char head[Ttl::HEADER];
+    Ttl::write(head, expires);
+    obj->_wb->put(baton->keybuf.data, baton->keybuf.size,
+                  node::Buffer::Data(buf), node::Buffer::Length(buf),
+                  head, obj->_ttl ? Ttl::HEADER : 0);
+    obj->buffered();
+    baton->callback = Persistent<Function>::New(cb);
+    baton->call = "put";
+    baton->ret = 0;
+    WorkPool::complete(req, (uv_after_work_cb)PutAfter);
+    return args.This();
+  }
 
   dbt_set(&baton->inbuf,
           node::Buffer::Data(buf),
@@ -325,37 +1529,27 @@ Handle<Value> DbStore::Put(const Arguments& args) {
   baton->data = Persistent<Value>::New(buf); // Ensure not GCed until complete
   baton->callback = Persistent<Function>::New(cb);
 
-  uv_queue_work(uv_default_loop(), req, PutWork, (uv_after_work_cb)PutAfter);
+  obj->queue(WorkPool::WRITE, baton, PutWork, (uv_after_work_cb)WriteAfter);
 
   return args.This();
 }
 
+// Heap, queue and recno stores pick the key of a new record themselves:
+// a record number, or a DB_HEAP_RID for heap.
 static void
-GetWork(uv_work_t *req) {
+AppendWork(uv_work_t *req) {
   WorkBaton *baton = (WorkBaton *) req->data;
 
   DbStore *store = baton->store;
 
-  DBT key_dbt;
-  dbt_set(&key_dbt, baton->str_arg, strlen(baton->str_arg));
-
-  DBT *retbuf = &baton->retbuf;
-  dbt_set(retbuf, 0, 0, DB_DBT_MALLOC);
-
-  baton->call = "get";
-  baton->ret = store->get(&key_dbt, retbuf, 0);
-  //fprintf(stderr, "get %s => %p[%d]\n", baton->str_arg, key_dbt.data, key_dbt.size);
-}
+  baton->bulk = dbt_encode(store, &baton->inbuf, baton->expires);
 
-static void
-free_buf(char *data, void *hint)
-{
-  //fprintf(stderr, "Free %p\n", data);
-  free(data);
+  baton->call = "append";
+  baton->ret = store->put(baton->txn, &baton->keybuf, &baton->inbuf, DB_APPEND);
 }
 
 static void
-GetAfter(uv_work_t *req, int status) {
+AppendAfter(uv_work_t *req, int status) {
   HandleScope scope;
 
   // fetch our data structure
@@ -363,96 +1557,1992 @@ GetAfter(uv_work_t *req, int status) {
 
   // create an arguments array for the callback
   Handle<Value> argv[2];
-
-  DBT *retbuf = &baton->retbuf;
-  node::Buffer *buf = node::Buffer::New((char*)retbuf->data, retbuf->size,
-                                        free_buf, NULL);
-  argv[1] = buf->handle_;
+  if (baton->ret) {
+    argv[1] = Local<Value>::New(Undefined());
+  } else if (baton->store->type() == DB_HEAP) {
+    baton->store->invalidate(baton->keybuf.data, baton->keybuf.size);
+    argv[1] = dbt_to_buffer(&baton->keybuf);
+  } else {
+    db_recno_t recno;
+    memcpy(&recno, baton->keybuf.data, sizeof(recno));
+    baton->store->invalidate(&recno, sizeof(recno));
+    argv[1] = Integer::NewFromUnsigned(recno);
+  }
   After(baton, argv, 2);
 }
 
-Handle<Value> DbStore::Get(const Arguments& args) {
+Handle<Value> DbStore::Append(const Arguments& args) {
   HandleScope scope;
 
   DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
 
-  if (! args.Length() > 0 && ! args[0]->IsString()) {
-     ThrowException(Exception::TypeError(String::New("First argument must be a string")));
+  if (! node::Buffer::HasInstance(args[0])) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a Buffer")));
     return scope.Close(Undefined());
   }
-  String::Utf8Value key(args[0]);
+  Handle<Object> buf = args[0]->ToObject();
 
-  if (! args.Length() > 1 && ! args[1]->IsFunction()) {
+  u_int32_t expires;
+  int txn_at = ttl_arg(args, 1, obj, &expires);
+  if (txn_at < 0) return scope.Close(Undefined());
+
+  DB_TXN *txn;
+  int cb_arg = txn_arg(args, txn_at, &txn);
+  if (cb_arg < 0) return scope.Close(Undefined());
+
+  if (! args[cb_arg]->IsFunction()) {
     ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
     return scope.Close(Undefined());
   }
 
   // create an async work token
-  uv_work_t *req = new uv_work_t;
+  uv_work_t *req = WorkPool::new_req();
 
   // assign our data structure that will be passed around
   WorkBaton *baton = new WorkBaton(req, obj);
   req->data = baton;
 
-  baton->str_arg = strdup(*key);
-  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+  // Room for whichever kind of key comes back
+  size_t klen = sizeof(DB_HEAP_RID) > sizeof(db_recno_t) ? sizeof(DB_HEAP_RID) : sizeof(db_recno_t);
+  baton->str_arg = (char *) calloc(1, klen);
+  dbt_set(&baton->keybuf, baton->str_arg, 0);
+  baton->keybuf.ulen = klen;
+  baton_txn(baton, txn, args[txn_at]);
+  baton->expires = expires;
+  obj->forget_gets();
+
+  dbt_set(&baton->inbuf,
+          node::Buffer::Data(buf),
+          node::Buffer::Length(buf));
+
+  baton->data = Persistent<Value>::New(buf); // Ensure not GCed until complete
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
 
-  uv_queue_work(uv_default_loop(), req, GetWork, (uv_after_work_cb)GetAfter);
+  obj->queue(WorkPool::WRITE, baton, AppendWork, (uv_after_work_cb)AppendAfter);
 
   return args.This();
 }
 
+// Re-pack the baton's DB_MULTIPLE_KEY (or recno) buffer with every value
+// run through the store's codec.  Done here rather than when the buffer
+// is built so compression stays off the loop thread.  Expiry headers are
+// already in place and stay in front.
 static void
-DelWork(uv_work_t *req) {
+bulk_encode(DbStore *store, WorkBaton *baton)
+{
+  if (store->codec() == Codec::NONE) return;
+
+  bool recno = store->type() == DB_QUEUE || store->type() == DB_RECNO;
+  DBT *in = &baton->inbuf;
+
+  // Encoding adds at most a header per value
+  u_int32_t n = 0, biggest = 0;
+  void *p, *k, *d;
+  u_int32_t klen, dlen;
+  db_recno_t rn;
+  DB_MULTIPLE_INIT(p, in);
+  for (;;) {
+    if (recno) DB_MULTIPLE_RECNO_NEXT(p, in, rn, d, dlen);
+    else DB_MULTIPLE_KEY_NEXT(p, in, k, klen, d, dlen);
+    if (! p) break;
+    if (dlen > biggest) biggest = dlen;
+    n++;
+  }
+  size_t size = in->ulen + n * Codec::bound(0);
+  size = (size + sizeof(u_int32_t) - 1) & ~(sizeof(u_int32_t) - 1);
+
+  char *bulk = (char *) malloc(size);
+  char *scratch = (char *) malloc(Codec::bound(biggest));
+  DBT out;
+  dbt_set(&out, bulk, 0);
+  out.ulen = size;
+
+  void *op, *kp, *dp;
+  DB_MULTIPLE_WRITE_INIT(op, &out);
+  DB_MULTIPLE_INIT(p, in);
+  for (;;) {
+    if (recno) DB_MULTIPLE_RECNO_NEXT(p, in, rn, d, dlen);
+    else DB_MULTIPLE_KEY_NEXT(p, in, k, klen, d, dlen);
+    if (! p) break;
+
+    u_int32_t head = store->ttl() ? Ttl::HEADER : 0;
+    memcpy(scratch, d, head);
+    u_int32_t elen = head + Codec::encode(store->codec(), store->codec_threshold(),
+                                          (char *) d + head, dlen - head,
+                                          scratch + head);
+    if (recno) {
+      DB_MULTIPLE_RECNO_RESERVE_NEXT(op, &out, rn, dp, elen);
+    } else {
+      DB_MULTIPLE_KEY_RESERVE_NEXT(op, &out, kp, klen, dp, elen);
+      memcpy(kp, k, klen);
+    }
+    memcpy(dp, scratch, elen);
+  }
+  out.size = size;
+  free(scratch);
+
+  free(baton->bulk);
+  baton->bulk = bulk;
+  baton->inbuf = out;
+}
+
+static void
+PutManyWork(uv_work_t *req) {
   WorkBaton *baton = (WorkBaton *) req->data;
 
   DbStore *store = baton->store;
+  bulk_encode(store, baton);
 
-  DBT key_dbt;
-  dbt_set(&key_dbt, baton->str_arg, strlen(baton->str_arg));
+  // The data DBT is ignored for DB_MULTIPLE_KEY, the pairs are all in inbuf.
+  DBT data_dbt;
+  dbt_set(&data_dbt, 0, 0);
 
-  //fprintf(stderr, "%p/%p: del %s\n", baton, req, baton->str_arg);
-  baton->call = "del";
-  baton->ret = store->del(&key_dbt, 0);
-  //fprintf(stderr, "%p/%p: del %s => %d\n", baton, req, baton->str_arg, baton->ret);
+  baton->call = "putMany";
+  baton->ret = store->put(baton->txn, &baton->inbuf, &data_dbt, DB_MULTIPLE_KEY);
 }
 
-Handle<Value> DbStore::Del(const Arguments& args) {
+static void
+PutManyAfter(uv_work_t *req, int status) {
+  WorkBaton *baton = (WorkBaton *)req->data;
+  DbStore *store = baton->store;
+
+  void *p, *k, *d;
+  u_int32_t klen, dlen;
+  DB_MULTIPLE_INIT(p, &baton->inbuf);
+  if (store->type() == DB_QUEUE || store->type() == DB_RECNO) {
+    db_recno_t rn;
+    for (;;) {
+      DB_MULTIPLE_RECNO_NEXT(p, &baton->inbuf, rn, d, dlen);
+      if (! p) break;
+      store->invalidate(&rn, sizeof(rn));
+    }
+  } else {
+    for (;;) {
+      DB_MULTIPLE_KEY_NEXT(p, &baton->inbuf, k, klen, d, dlen);
+      if (! p) break;
+      store->invalidate(k, klen);
+    }
+  }
+  (void) d; (void) dlen;
+
+  PutAfter(req, status);
+}
+
+Handle<Value> DbStore::PutMany(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! args[0]->IsArray()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be an Array of [key, Buffer] pairs")));
+    return scope.Close(Undefined());
+  }
+  Local<Array> pairs = Local<Array>::Cast(args[0]);
+
+  u_int32_t expires;
+  int txn_at = ttl_arg(args, 1, obj, &expires);
+  if (txn_at < 0) return scope.Close(Undefined());
+  u_int32_t head = obj->_ttl ? Ttl::HEADER : 0;
+
+  DB_TXN *txn;
+  int cb_arg = txn_arg(args, txn_at, &txn);
+  if (cb_arg < 0) return scope.Close(Undefined());
+
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (obj->_wb && txn) {
+    ThrowException(Exception::Error(String::New("Write-behind stores don't take transactions")));
+    return scope.Close(Undefined());
+  }
+
+  // Queue and recno keys go in the offset table as record numbers
+  bool recno = obj->type() == DB_QUEUE || obj->type() == DB_RECNO;
+
+  // Size the bulk buffer first: the pairs are copied in from the front and
+  // the offset table (four u_int32_t per pair, plus terminator) grows back
+  // from the end, which must stay u_int32_t aligned.
+  u_int32_t count = pairs->Length();
+  size_t size = 0;
+  for (u_int32_t i = 0; i < count; ++i) {
+    Local<Value> pair = pairs->Get(i);
+    if (! pair->IsArray()) {
+      ThrowException(Exception::TypeError(String::New("Each element must be a [key, Buffer] pair")));
+      return scope.Close(Undefined());
+    }
+    Local<Object> kv = pair->ToObject();
+    Local<Value> key = kv->Get(0);
+    Local<Value> val = kv->Get(1);
+    if (! is_key(key) || ! node::Buffer::HasInstance(val)) {
+      ThrowException(Exception::TypeError(String::New("Each element must be a [key, Buffer] pair")));
+      return scope.Close(Undefined());
+    }
+    if (recno && key_length(key) != sizeof(db_recno_t)) {
+      ThrowException(Exception::TypeError(String::New("Keys must be record numbers")));
+      return scope.Close(Undefined());
+    }
+    size += key_length(key) + head + node::Buffer::Length(val);
+  }
+  size = (size + sizeof(u_int32_t) - 1) & ~(sizeof(u_int32_t) - 1);
+  size += (4 * count + 1) * sizeof(u_int32_t);
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  WorkBaton *baton = new WorkBaton(req, obj);
+  req->data = baton;
+
+  baton->bulk = (char *) malloc(size);
+  DBT *bulk = &baton->inbuf;
+  dbt_set(bulk, baton->bulk, 0);
+  bulk->ulen = size;
+
+  void *p, *kp, *dp;
+  DB_MULTIPLE_WRITE_INIT(p, bulk);
+  for (u_int32_t i = 0; i < count; ++i) {
+    Local<Object> kv = pairs->Get(i)->ToObject();
+    Local<Value> key = kv->Get(0);
+    Local<Value> val = kv->Get(1);
+    size_t klen = key_length(key);
+    size_t dlen = node::Buffer::Length(val);
+    if (recno) {
+      db_recno_t rn;
+      key_write(key, (char *) &rn, klen);
+      DB_MULTIPLE_RECNO_RESERVE_NEXT(p, bulk, rn, dp, head + dlen);
+      obj->invalidate(&rn, klen);
+    } else {
+      DB_MULTIPLE_KEY_RESERVE_NEXT(p, bulk, kp, klen, dp, head + dlen);
+      key_write(key, (char *) kp, klen);
+      obj->invalidate(kp, klen);
+    }
+    if (head) Ttl::write(dp, expires);
+    memcpy((char *) dp + head, node::Buffer::Data(val), dlen);
+  }
+  bulk->size = size;
+
+  baton_txn(baton, txn, args[txn_at]);
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  if (obj->_wb) {
+    void *k, *d;
+    u_int32_t klen, dlen;
+    DB_MULTIPLE_INIT(p, bulk);
+    for (;;) {
+      if (recno) {
+        db_recno_t rn;
+        DB_MULTIPLE_RECNO_NEXT(p, bulk, rn, d, dlen);
+        if (! p) break;
+        obj->_wb->put(&rn, sizeof(rn), d, dlen);
+      } else {
+        DB_MULTIPLE_KEY_NEXT(p, bulk, k, klen, d, dlen);
+        if (! p) break;
+        obj->_wb->put(k, klen, d, dlen);
+      }
+    }
+    obj->buffered();
+    baton->call = "putMany";
+    baton->ret = 0;
+    WorkPool::complete(req, (uv_after_work_cb)PutAfter);
+    return args.This();
+  }
+
+  obj->queue(WorkPool::WRITE, baton, PutManyWork, (uv_after_work_cb)PutManyAfter);
+
+  return args.This();
+}
+
+static void
+GetWork(uv_work_t *req) {
+  WorkBaton *baton = (WorkBaton *) req->data;
+
+  DbStore *store = baton->store;
+
+  baton->call = "get";
+  baton->ret = pooled_get(store, baton->txn, &baton->keybuf, &baton->retbuf);
+  if (! baton->ret) {
+    baton->ret = dbt_decode(store, &baton->retbuf, Ttl::now(), &baton->expires);
+  }
+}
+
+static void
+GetAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  WorkBaton *baton = (WorkBaton *)req->data;
+
+  if (baton->in_flight) {
+    baton->store->forget_get(baton->keybuf.data, baton->keybuf.size);
+  }
+
+  // create an arguments array for the callback
+  Handle<Value> argv[2];
+
+  if (baton->ret) {
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    // Values that expire aren't cached, the cache can't drop them in time
+    ValueCache *cache = baton->store->cache();
+    if (cache && ! baton->txn && ! baton->expires) {
+      cache->fill(baton->keybuf.data, baton->keybuf.size,
+                  baton->retbuf.data, baton->retbuf.size, baton->cache_version);
+    }
+    argv[1] = dbt_to_buffer(&baton->retbuf);
+  }
+
+  // Gets that joined this one are answered with the same Buffer
+  bool shared = ! baton->data.IsEmpty();
+  Local<Value> joined = Local<Value>::New(baton->data);
+  After(baton, argv, 2);
+
+  if (! shared) return;
+  Local<Array> callbacks = Local<Array>::Cast(joined);
+  for (u_int32_t i = 0; i < callbacks->Length(); ++i) {
+    TryCatch try_catch;
+    Local<Function>::Cast(callbacks->Get(i))->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught())
+      node::FatalException(try_catch);
+  }
+}
+
+// Answer a get from the write-behind buffer: a malloc'ed copy of a
+// buffered value into retbuf, or DB_NOTFOUND for a buffered del or an
+// expired value.  Returns false if the key isn't buffered.
+static bool
+buffered_get(DbStore *store, void const *key, u_int32_t klen, DBT *retbuf, int *ret,
+             u_int32_t *expires = NULL)
+{
+  WriteBuffer *wb = store->write_buffer();
+  if (! wb) return false;
+
+  char *data;
+  u_int32_t dlen;
+  switch (wb->get(key, klen, &data, &dlen)) {
+  case WriteBuffer::MISSING:
+    return false;
+  case WriteBuffer::DELETED:
+    *ret = DB_NOTFOUND;
+    return true;
+  default:
+    if (store->ttl()) {
+      u_int32_t when = Ttl::read(data);
+      if (Ttl::expired(when, Ttl::now())) {
+        *ret = DB_NOTFOUND;
+        return true;
+      }
+      if (expires) *expires = when;
+      data += Ttl::HEADER;
+      dlen -= Ttl::HEADER;
+    }
+    dbt_set(retbuf, malloc(dlen ? dlen : 1), dlen, DB_DBT_MALLOC);
+    memcpy(retbuf->data, data, dlen);
+    *ret = 0;
+    return true;
+  }
+}
+
+Handle<Value> DbStore::Get(const Arguments& args) {
   HandleScope scope;
 
   DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
 
-  if (! args.Length() > 0 && ! args[0]->IsString()) {
-     ThrowException(Exception::TypeError(String::New("First argument must be a string")));
+  if (! is_key(args[0])) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a String or Buffer key")));
     return scope.Close(Undefined());
   }
-  String::Utf8Value key(args[0]);
 
-  if (! args.Length() > 1 && ! args[1]->IsFunction()) {
+  DB_TXN *txn;
+  int cb_arg = txn_arg(args, 1, &txn);
+  if (cb_arg < 0) return scope.Close(Undefined());
+
+  if (! args[cb_arg]->IsFunction()) {
     ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
     return scope.Close(Undefined());
   }
 
+  // Join a get of the same key that is already under way.  Reads in a
+  // transaction may see its own writes, so they always go on their own.
+  if (! txn) {
+    KeyBytes key(args[0]);
+    WorkBaton *flight = obj->find_get(key.data, key.length);
+    if (flight) {
+      if (flight->data.IsEmpty()) {
+        flight->data = Persistent<Value>::New(Array::New());
+      }
+      Local<Array> callbacks = Local<Array>::Cast(Local<Value>::New(flight->data));
+      callbacks->Set(callbacks->Length(), args[cb_arg]);
+      return args.This();
+    }
+  }
+
   // create an async work token
-  uv_work_t *req = new uv_work_t;
+  uv_work_t *req = WorkPool::new_req();
 
   // assign our data structure that will be passed around
   WorkBaton *baton = new WorkBaton(req, obj);
   req->data = baton;
 
-  baton->str_arg = strdup(*key);
-  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+  baton_key(baton, args[0]);
+  baton_txn(baton, txn, args[1]);
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  baton->call = "get";
+  if (buffered_get(obj, baton->keybuf.data, baton->keybuf.size, &baton->retbuf,
+                   &baton->ret, &baton->expires)) {
+    WorkPool::complete(req, (uv_after_work_cb)GetAfter);
+    return args.This();
+  }
+
+  if (! txn) {
+    obj->add_get(baton);
+    if (obj->_cache) {
+      baton->cache_version = obj->_cache->version(baton->keybuf.data, baton->keybuf.size);
+    }
+  }
 
-  uv_queue_work(uv_default_loop(), req, DelWork, (uv_after_work_cb)PutAfter); // Yes, use the same.
+  obj->queue(WorkPool::READ, baton, GetWork, (uv_after_work_cb)GetAfter);
 
   return args.This();
 }
 
-Handle<Value> DbStore::Sync(const Arguments& args) {
+// Look a key up on the calling thread.  This skips the threadpool round
+// trip, which is most of the cost for keys whose pages are already in the
+// cache, but blocks the event loop for the duration of any disk read.
+Handle<Value> DbStore::GetSync(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! is_key(args[0])) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a String or Buffer key")));
+    return scope.Close(Undefined());
+  }
+  KeyBytes key(args[0]);
+
+  if (! obj->_open) {
+    ThrowException(Exception::Error(String::New("DbStore is not open")));
+    return scope.Close(Undefined());
+  }
+
+  char *data;
+  u_int32_t dlen;
+  if (obj->_cache && obj->_cache->get(key.data, key.length, &data, &dlen)) {
+    return scope.Close(node::Buffer::New(data, dlen)->handle_);
+  }
+
+  DBT retbuf;
+  int ret;
+  if (buffered_get(obj, key.data, key.length, &retbuf, &ret)) {
+    if (ret) return scope.Close(Undefined());
+    return scope.Close(dbt_to_buffer(&retbuf));
+  }
+
+  DBT key_dbt;
+  dbt_set(&key_dbt, key.data, key.length);
+
+  ret = pooled_get(obj, NULL, &key_dbt, &retbuf);
+  if (ret == DB_NOTFOUND) {
+    return scope.Close(Undefined());
+  }
+  u_int32_t expires = 0;
+  if (! ret) {
+    ret = dbt_decode(obj, &retbuf, Ttl::now(), &expires);
+  }
+  if (ret == DB_NOTFOUND) {
+    dbt_free(&retbuf);
+    return scope.Close(Undefined());
+  }
+  if (ret) {
+    ThrowException(node::UVException(0, "getSync", db_strerror(ret)));
+    return scope.Close(Undefined());
+  }
+
+  if (obj->_cache && ! expires) {
+    u_int32_t version = obj->_cache->version(key.data, key.length);
+    obj->_cache->fill(key.data, key.length, retbuf.data, retbuf.size, version);
+  }
+  return scope.Close(dbt_to_buffer(&retbuf));
+}
+
+// A copy of the buffered or cached value of a key, or undefined.  Never
+// touches the database.
+Handle<Value> DbStore::Cached(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if ((! obj->_cache && ! obj->_wb) || ! is_key(args[0])) {
+    return scope.Close(Undefined());
+  }
+  KeyBytes key(args[0]);
+
+  DBT retbuf;
+  int ret;
+  if (buffered_get(obj, key.data, key.length, &retbuf, &ret)) {
+    if (ret) return scope.Close(Undefined());
+    return scope.Close(dbt_to_buffer(&retbuf));
+  }
+
+  char *data;
+  u_int32_t dlen;
+  if (! obj->_cache || ! obj->_cache->get(key.data, key.length, &data, &dlen)) {
+    return scope.Close(Undefined());
+  }
+  return scope.Close(node::Buffer::New(data, dlen)->handle_);
+}
+
+Handle<Value> DbStore::CacheStats(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! obj->_cache) {
+    return scope.Close(Undefined());
+  }
+  return scope.Close(obj->_cache->stats());
+}
+
+// Latency histograms of each kind of operation so far, in microseconds.
+// { reset: true } starts them over once read.
+Handle<Value> DbStore::Stats(const Arguments& args) {
   HandleScope scope;
 
-  //DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
 
-  return scope.Close(Number::New(0));
+  Handle<Object> stats = obj->_stats.stats();
+  if (args[0]->IsObject() &&
+      args[0]->ToObject()->Get(String::NewSymbol("reset"))->BooleanValue()) {
+    obj->_stats.reset();
+  }
+  return scope.Close(stats);
 }
 
+static void
+GetManyWork(uv_work_t *req) {
+  WorkBaton *baton = (WorkBaton *) req->data;
+
+  DbStore *store = baton->store;
+
+  baton->call = "getMany";
+  baton->ret = 0;
+  u_int32_t now = Ttl::now();
+  for (u_int32_t i = 0; i < baton->count; ++i) {
+    DBT *key_dbt = &baton->dbts[2*i];
+    DBT *retbuf = &baton->dbts[2*i+1];
+
+    // Already answered from the write-behind buffer
+    if (retbuf->flags) continue;
+
+    // Missing keys are left with no data
+    int ret = pooled_get(store, baton->txn, key_dbt, retbuf);
+    if (! ret) {
+      ret = dbt_decode(store, retbuf, now);
+      if (ret == DB_NOTFOUND) dbt_free(retbuf);
+    }
+    if (ret && ret != DB_NOTFOUND) {
+      baton->ret = ret;
+      break;
+    }
+  }
+}
+
+static void
+GetManyAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  WorkBaton *baton = (WorkBaton *)req->data;
+
+  // create an arguments array for the callback
+  Handle<Value> argv[2];
+
+  // Missing keys come back as undefined in their slot
+  Local<Array> values = Array::New(baton->count);
+  if (! baton->ret) {
+    for (u_int32_t i = 0; i < baton->count; ++i) {
+      DBT *retbuf = &baton->dbts[2*i+1];
+      if (! retbuf->data) continue;
+      values->Set(i, dbt_to_buffer(retbuf));
+    }
+  }
+  argv[1] = values;
+  After(baton, argv, 2);
+}
+
+Handle<Value> DbStore::GetMany(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! args[0]->IsArray()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be an Array of keys")));
+    return scope.Close(Undefined());
+  }
+  Local<Array> keys = Local<Array>::Cast(args[0]);
+
+  DB_TXN *txn;
+  int cb_arg = txn_arg(args, 1, &txn);
+  if (cb_arg < 0) return scope.Close(Undefined());
+
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  u_int32_t count = keys->Length();
+  size_t size = 0;
+  for (u_int32_t i = 0; i < count; ++i) {
+    Local<Value> key = keys->Get(i);
+    if (! is_key(key)) {
+      ThrowException(Exception::TypeError(String::New("Keys must be Strings or Buffers")));
+      return scope.Close(Undefined());
+    }
+    size += key_length(key);
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  WorkBaton *baton = new WorkBaton(req, obj);
+  req->data = baton;
+
+  // All keys are packed into one allocation
+  baton->bulk = (char *) malloc(size ? size : 1);
+  baton->dbts = (DBT *) calloc(2 * count + 1, sizeof(DBT));
+  baton->count = count;
+
+  char *p = baton->bulk;
+  for (u_int32_t i = 0; i < count; ++i) {
+    Local<Value> key = keys->Get(i);
+    size_t len = key_length(key);
+    key_write(key, p, len);
+    dbt_set(&baton->dbts[2*i], p, len);
+    p += len;
+
+    DBT *retbuf = &baton->dbts[2*i+1];
+    int ret;
+    if (buffered_get(obj, baton->dbts[2*i].data, len, retbuf, &ret) && ret) {
+      dbt_set(retbuf, 0, 0, DB_DBT_MALLOC);
+    }
+  }
+
+  baton_txn(baton, txn, args[1]);
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  obj->queue(WorkPool::READ, baton, GetManyWork, (uv_after_work_cb)GetManyAfter);
+
+  return args.This();
+}
+
+static void
+DelWork(uv_work_t *req) {
+  WorkBaton *baton = (WorkBaton *) req->data;
+
+  DbStore *store = baton->store;
+
+  //fprintf(stderr, "%p/%p: del\n", baton, req);
+  baton->call = "del";
+  baton->ret = store->del(baton->txn, &baton->keybuf, 0);
+  //fprintf(stderr, "%p/%p: del => %d\n", baton, req, baton->ret);
+}
+
+Handle<Value> DbStore::Del(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! is_key(args[0])) {
+    ThrowException(Exception::TypeError(String::New("First argument must be a String or Buffer key")));
+    return scope.Close(Undefined());
+  }
+
+  DB_TXN *txn;
+  int cb_arg = txn_arg(args, 1, &txn);
+  if (cb_arg < 0) return scope.Close(Undefined());
+
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (obj->_wb && txn) {
+    ThrowException(Exception::Error(String::New("Write-behind stores don't take transactions")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  WorkBaton *baton = new WorkBaton(req, obj);
+  req->data = baton;
+
+  baton_key(baton, args[0]);
+  baton_txn(baton, txn, args[1]);
+  obj->invalidate(baton->keybuf.data, baton->keybuf.size);
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  // A buffered del can't know whether the key exists, so it succeeds
+  if (obj->_wb) {
+    obj->_wb->del(baton->keybuf.data, baton->keybuf.size);
+    obj->buffered();
+    baton->call = "del";
+    baton->ret = 0;
+    WorkPool::complete(req, (uv_after_work_cb)PutAfter);
+    return args.This();
+  }
+
+  obj->queue(WorkPool::WRITE, baton, DelWork, (uv_after_work_cb)WriteAfter);
+
+  return args.This();
+}
+
+// A range scan fetches one bulk page of records per trip to the worker
+// thread.  The cursor is closed again before returning, so nothing stays
+// locked between pages; the JS iterator resumes after the last key seen.
+struct ScanBaton : public WorkBaton {
+  char *start;            // where the scan begins, NULL for first/last
+  u_int32_t start_len;
+  bool start_inclusive;
+  char *end;              // where the scan stops, NULL for last/first
+  u_int32_t end_len;
+  bool end_inclusive;
+  bool reverse;
+  bool ordered;           // keys come back in key_cmp order
+  bool recno;             // keys are record numbers
+  u_int32_t limit;        // max records this trip, 0 for a full page
+  u_int32_t bufsize;      // bulk buffer size
+  u_int32_t bytes;        // bytes collected by a reverse scan
+  u_int32_t capacity;     // allocated pairs in dbts
+  bool done;              // no records remain in the range
+  u_int32_t now;          // records expired by now are skipped
+
+  ScanBaton(uv_work_t *_r, DbStore *_s);
+  ~ScanBaton();
+};
+
+ScanBaton::ScanBaton(uv_work_t *_r, DbStore *_s)
+  : WorkBaton(_r, _s), start(0), start_len(0), start_inclusive(true),
+    end(0), end_len(0), end_inclusive(false), reverse(false),
+    ordered(true), recno(false), limit(0), bufsize(64 * 1024), bytes(0), capacity(0), done(false), now(0) {
+}
+ScanBaton::~ScanBaton() {
+  if (start) free(start);
+  if (end) free(end);
+}
+
+// Has the scan reached the start of the range?
+static bool
+scan_started(ScanBaton *baton, void const *key, u_int32_t klen)
+{
+  if (! baton->start) return true;
+  int c = key_cmp(key, klen, baton->start, baton->start_len);
+  if (! baton->ordered) {
+    // Storage order, the cursor was positioned on the start key itself
+    return c != 0 || baton->start_inclusive;
+  }
+  if (baton->reverse) c = -c;
+  return c > 0 || (c == 0 && baton->start_inclusive);
+}
+
+// Is the key still short of the end of the range?
+static bool
+scan_in_range(ScanBaton *baton, void const *key, u_int32_t klen)
+{
+  if (! baton->end) return true;
+  int c = key_cmp(key, klen, baton->end, baton->end_len);
+  if (baton->reverse) c = -c;
+  return c < 0 || (c == 0 && baton->end_inclusive);
+}
+
+static void
+scan_push(ScanBaton *baton, void *key, u_int32_t klen,
+          void *data, u_int32_t dlen, u_int32_t flags)
+{
+  if (baton->count == baton->capacity) {
+    baton->capacity = baton->capacity ? 2 * baton->capacity : 64;
+    baton->dbts = (DBT *) realloc(baton->dbts, 2 * baton->capacity * sizeof(DBT));
+  }
+  dbt_set(&baton->dbts[2*baton->count], key, klen, flags);
+  dbt_set(&baton->dbts[2*baton->count+1], data, dlen, flags);
+  baton->count++;
+}
+
+// Expired records the sweeper hasn't got to yet
+static bool
+scan_expired(ScanBaton *baton, void const *data, u_int32_t dlen)
+{
+  if (! baton->store->ttl() || dlen < Ttl::HEADER) return false;
+  return Ttl::expired(Ttl::read(data), baton->now);
+}
+
+static bool
+scan_full(ScanBaton *baton)
+{
+  return baton->limit && baton->count >= baton->limit;
+}
+
+// Forward scans use DB_MULTIPLE_KEY, records point into the bulk buffer
+static int
+scan_forward(ScanBaton *baton, DBC *dbc)
+{
+  u_int32_t flags = DB_FIRST;
+
+  DBT key;
+  dbt_set(&key, 0, 0, DB_DBT_REALLOC);
+  if (baton->start) {
+    key.data = malloc(baton->start_len);
+    memcpy(key.data, baton->start, baton->start_len);
+    key.size = baton->start_len;
+    flags = DB_SET_RANGE;
+  }
+
+  DBT data;
+  dbt_set(&data, baton->bulk, 0);
+  data.ulen = baton->bufsize;
+
+  int ret;
+  for (;;) {
+    ret = dbc->get(dbc, &key, &data, flags | DB_MULTIPLE_KEY);
+    if (ret == DB_BUFFER_SMALL) {
+      // A single record bigger than the page, grow to fit it and retry.
+      baton->bufsize = (data.size + 1023) & ~1023;
+      baton->bulk = (char *) realloc(baton->bulk, baton->bufsize);
+      data.data = baton->bulk;
+      data.ulen = baton->bufsize;
+      continue;
+    }
+    if (ret == DB_NOTFOUND) {
+      // Hash and heap stores can only be positioned on a key that is
+      // there.  If the key an iterator resumes from was deleted there is
+      // nowhere to carry on from, and ending quietly would skip the rest.
+      if (flags == DB_SET_RANGE && ! baton->ordered) break;
+      ret = 0;
+      baton->done = true;
+      break;
+    }
+    if (ret) break;
+
+    void *p, *k, *d;
+    u_int32_t klen, dlen;
+    DB_MULTIPLE_INIT(p, &data);
+    for (;;) {
+      DB_MULTIPLE_KEY_NEXT(p, &data, k, klen, d, dlen);
+      if (! p) break;
+      if (! scan_started(baton, k, klen)) continue;
+      if (! scan_in_range(baton, k, klen)) {
+        baton->done = true;
+        break;
+      }
+      if (scan_expired(baton, d, dlen)) continue;
+      scan_push(baton, k, klen, d, dlen, 0);
+      if (scan_full(baton)) break;
+    }
+
+    // Only go around again if everything in the page was skipped
+    if (baton->count || baton->done) break;
+    flags = DB_NEXT;
+  }
+
+  if (key.data) free(key.data);
+  return ret;
+}
+
+// There is no bulk DB_PREV, so reverse scans fetch record by record until
+// they have collected a page's worth of data.
+static int
+scan_reverse(ScanBaton *baton, DBC *dbc)
+{
+  u_int32_t flags = DB_LAST;
+  int ret;
+
+  DBT key, data;
+  if (baton->start) {
+    // Position at the first key >= start, then step back from there.
+    char *in = (char *) malloc(baton->start_len);
+    memcpy(in, baton->start, baton->start_len);
+    dbt_set(&key, in, baton->start_len, DB_DBT_MALLOC);
+    dbt_set(&data, 0, 0, DB_DBT_MALLOC);
+
+    ret = dbc->get(dbc, &key, &data, DB_SET_RANGE);
+    if (key.data == in) key.data = NULL;
+    free(in);
+
+    if (ret == 0) {
+      if (scan_started(baton, key.data, key.size) &&
+          scan_in_range(baton, key.data, key.size) &&
+          ! scan_expired(baton, data.data, data.size)) {
+        scan_push(baton, key.data, key.size, data.data, data.size, DB_DBT_MALLOC);
+        baton->bytes += key.size + data.size;
+      } else {
+        free(key.data);
+        free(data.data);
+      }
+      flags = DB_PREV;
+    } else if (ret != DB_NOTFOUND) {
+      return ret;
+    }
+  }
+
+  while (! scan_full(baton) && baton->bytes < baton->bufsize) {
+    dbt_set(&key, 0, 0, DB_DBT_MALLOC);
+    dbt_set(&data, 0, 0, DB_DBT_MALLOC);
+
+    ret = dbc->get(dbc, &key, &data, flags);
+    flags = DB_PREV;
+    if (ret == DB_NOTFOUND) {
+      baton->done = true;
+      break;
+    }
+    if (ret) return ret;
+
+    if (! scan_in_range(baton, key.data, key.size)) {
+      free(key.data);
+      free(data.data);
+      baton->done = true;
+      break;
+    }
+    if (scan_expired(baton, data.data, data.size)) {
+      free(key.data);
+      free(data.data);
+      continue;
+    }
+    scan_push(baton, key.data, key.size, data.data, data.size, DB_DBT_MALLOC);
+    baton->bytes += key.size + data.size;
+  }
+  return 0;
+}
+
+// Queue and recno bulk reads carry the record number in the offset table,
+// so each key is copied out into memory of its own.
+static int
+scan_recno(ScanBaton *baton, DBC *dbc)
+{
+  u_int32_t flags = DB_FIRST;
+
+  db_recno_t start = 0;
+  DBT key;
+  dbt_set(&key, &start, sizeof(start));
+  key.ulen = sizeof(start);
+  if (baton->start) {
+    if (baton->start_len != sizeof(start)) return EINVAL;
+    memcpy(&start, baton->start, sizeof(start));
+    flags = DB_SET_RANGE;
+  }
+
+  DBT data;
+  dbt_set(&data, baton->bulk, 0);
+  data.ulen = baton->bufsize;
+
+  int ret;
+  for (;;) {
+    ret = dbc->get(dbc, &key, &data, flags | DB_MULTIPLE_KEY);
+    if (ret == DB_BUFFER_SMALL) {
+      baton->bufsize = (data.size + 1023) & ~1023;
+      baton->bulk = (char *) realloc(baton->bulk, baton->bufsize);
+      data.data = baton->bulk;
+      data.ulen = baton->bufsize;
+      continue;
+    }
+    if (ret == DB_NOTFOUND) {
+      ret = 0;
+      baton->done = true;
+      break;
+    }
+    if (ret) break;
+
+    void *p, *d;
+    db_recno_t rn;
+    u_int32_t dlen;
+    DB_MULTIPLE_INIT(p, &data);
+    for (;;) {
+      DB_MULTIPLE_RECNO_NEXT(p, &data, rn, d, dlen);
+      if (! p) break;
+      if (! scan_started(baton, &rn, sizeof(rn))) continue;
+      if (scan_expired(baton, d, dlen)) continue;
+      db_recno_t *k = (db_recno_t *) malloc(sizeof(rn));
+      *k = rn;
+      scan_push(baton, k, sizeof(rn), d, dlen, 0);
+      baton->dbts[2*baton->count-2].flags = DB_DBT_MALLOC;
+      if (scan_full(baton)) break;
+    }
+
+    if (baton->count) break;
+    flags = DB_NEXT;
+  }
+  return ret;
+}
+
+static void
+ScanWork(uv_work_t *req) {
+  ScanBaton *baton = (ScanBaton *) req->data;
+
+  DbStore *store = baton->store;
+
+  baton->call = "scan";
+  baton->now = Ttl::now();
+
+  DBC *dbc;
+  baton->ret = store->cursor(&dbc, 0);
+  if (baton->ret) return;
+
+  if (baton->reverse) {
+    baton->ret = scan_reverse(baton, dbc);
+  } else if (baton->recno) {
+    baton->bulk = (char *) malloc(baton->bufsize);
+    baton->ret = scan_recno(baton, dbc);
+  } else {
+    baton->bulk = (char *) malloc(baton->bufsize);
+    baton->ret = scan_forward(baton, dbc);
+  }
+
+  int ret = dbc->close(dbc);
+  if (! baton->ret) baton->ret = ret;
+
+  for (u_int32_t i = 0; i < baton->count && ! baton->ret; ++i) {
+    baton->ret = dbt_decode(store, &baton->dbts[2*i+1]);
+  }
+}
+
+static void
+ScanAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  ScanBaton *baton = (ScanBaton *)req->data;
+
+  // create an arguments array for the callback
+  Handle<Value> argv[4];
+
+  Local<Array> keys = Array::New(baton->count);
+  Local<Array> values = Array::New(baton->count);
+  if (! baton->ret) {
+    for (u_int32_t i = 0; i < baton->count; ++i) {
+      keys->Set(i, dbt_to_buffer(&baton->dbts[2*i]));
+      values->Set(i, dbt_to_buffer(&baton->dbts[2*i+1]));
+    }
+  }
+  argv[1] = keys;
+  argv[2] = values;
+  argv[3] = Local<Value>::New(Boolean::New(baton->done));
+  After(baton, argv, 4);
+}
+
+Handle<Value> DbStore::Scan(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! args[0]->IsObject()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be an options Object")));
+    return scope.Close(Undefined());
+  }
+  Local<Object> opts = args[0]->ToObject();
+
+  if (! args[1]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Second argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  // Only B-trees keep their keys in order, everything else is walked in
+  // storage order from the start key, if any, to the end.
+  bool ordered = obj->type() == DB_BTREE;
+  if (! ordered && is_key(opts->Get(String::NewSymbol("end")))) {
+    ThrowException(Exception::TypeError(String::New("Key ranges need a btree store")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  ScanBaton *baton = new ScanBaton(req, obj);
+  req->data = baton;
+  baton->ordered = ordered;
+  baton->recno = obj->type() == DB_QUEUE || obj->type() == DB_RECNO;
+
+  Local<Value> start = opts->Get(String::NewSymbol("start"));
+  if (is_key(start)) {
+    baton->start = bound_copy(start, &baton->start_len);
+    baton->start_inclusive = ! opts->Get(String::NewSymbol("startExclusive"))->BooleanValue();
+  }
+  Local<Value> end = opts->Get(String::NewSymbol("end"));
+  if (is_key(end)) {
+    baton->end = bound_copy(end, &baton->end_len);
+    baton->end_inclusive = opts->Get(String::NewSymbol("endInclusive"))->BooleanValue();
+  }
+  baton->reverse = opts->Get(String::NewSymbol("reverse"))->BooleanValue();
+
+  Local<Value> limit = opts->Get(String::NewSymbol("limit"));
+  if (limit->IsNumber() && limit->Uint32Value() > 0) {
+    baton->limit = limit->Uint32Value();
+  }
+
+  // Bulk buffers must be a multiple of 1KB and at least a page
+  Local<Value> bufsize = opts->Get(String::NewSymbol("bufferSize"));
+  if (bufsize->IsNumber() && bufsize->Uint32Value() > 0) {
+    baton->bufsize = bufsize->Uint32Value();
+  }
+  u_int32_t pagesize = obj->pagesize();
+  if (baton->bufsize < pagesize) baton->bufsize = pagesize;
+  baton->bufsize = (baton->bufsize + 1023) & ~1023;
+
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+
+  obj->queue(WorkPool::READ, baton, ScanWork, (uv_after_work_cb)ScanAfter);
+
+  return args.This();
+}
+
+// Records whose index keys equal every one of the terms, through a BDB
+// join of the index cursors.  Answered like a scan, keys and values.
+struct QueryBaton : public ScanBaton {
+  DbIndex **indexes;
+  DBT *terms;             // index keys, copied
+  u_int32_t nterms;
+
+  QueryBaton(uv_work_t *_r, DbStore *_s)
+    : ScanBaton(_r, _s), indexes(0), terms(0), nterms(0) {}
+  ~QueryBaton() {
+    for (u_int32_t i = 0; i < nterms; ++i) free(terms[i].data);
+    free(terms);
+    free(indexes);
+  }
+};
+
+static int
+query_join(QueryBaton *baton, DBC **curslist)
+{
+  DbStore *store = baton->store;
+
+  // Each cursor starts on the first duplicate of its term, a missing
+  // term means nothing matches
+  for (u_int32_t i = 0; i < baton->nterms; ++i) {
+    DB *sdb = baton->indexes[i]->db;
+    int ret = sdb->cursor(sdb, NULL, &curslist[i], 0);
+    if (ret) return ret;
+
+    DBT key, data;
+    dbt_set(&key, baton->terms[i].data, baton->terms[i].size);
+    dbt_set(&data, 0, 0, DB_DBT_MALLOC);
+    ret = curslist[i]->get(curslist[i], &key, &data, DB_SET);
+    free(data.data);
+    if (ret == DB_NOTFOUND) {
+      baton->done = true;
+      return 0;
+    }
+    if (ret) return ret;
+  }
+
+  DBC *jc;
+  int ret = store->join(curslist, &jc);
+  if (ret) return ret;
+
+  while (! scan_full(baton)) {
+    DBT key, data;
+    dbt_set(&key, 0, 0, DB_DBT_MALLOC);
+    dbt_set(&data, 0, 0, DB_DBT_MALLOC);
+    ret = jc->get(jc, &key, &data, 0);
+    if (ret == DB_NOTFOUND) {
+      ret = 0;
+      baton->done = true;
+      break;
+    }
+    if (ret) break;
+
+    if (scan_expired(baton, data.data, data.size)) {
+      free(key.data);
+      free(data.data);
+      continue;
+    }
+    scan_push(baton, key.data, key.size, data.data, data.size, DB_DBT_MALLOC);
+  }
+
+  int cret = jc->close(jc);
+  return ret ? ret : cret;
+}
+
+static void
+QueryWork(uv_work_t *req) {
+  QueryBaton *baton = (QueryBaton *) req->data;
+
+  DbStore *store = baton->store;
+
+  baton->call = "query";
+  baton->now = Ttl::now();
+
+  DBC **curslist = (DBC **) calloc(baton->nterms + 1, sizeof(DBC *));
+  baton->ret = query_join(baton, curslist);
+  for (u_int32_t i = 0; i < baton->nterms && curslist[i]; ++i) {
+    int ret = curslist[i]->close(curslist[i]);
+    if (! baton->ret) baton->ret = ret;
+  }
+  free(curslist);
+
+  for (u_int32_t i = 0; i < baton->count && ! baton->ret; ++i) {
+    baton->ret = dbt_decode(store, &baton->dbts[2*i+1]);
+  }
+}
+
+Handle<Value> DbStore::Query(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! args[0]->IsArray() || ! Local<Array>::Cast(args[0])->Length()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be an Array of [index, key] terms")));
+    return scope.Close(Undefined());
+  }
+  Local<Array> terms = Local<Array>::Cast(args[0]);
+
+  if (! args[2]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (! obj->_open) {
+    ThrowException(Exception::Error(String::New("DbStore is not open")));
+    return scope.Close(Undefined());
+  }
+
+  u_int32_t nterms = terms->Length();
+  DbIndex **indexes = (DbIndex **) malloc(nterms * sizeof(DbIndex *));
+  for (u_int32_t i = 0; i < nterms; ++i) {
+    Local<Value> term = terms->Get(i);
+    Local<Object> pair = term->IsArray() ? term->ToObject() : Object::New();
+    String::Utf8Value name(pair->Get(0));
+    indexes[i] = *name ? obj->index(*name) : NULL;
+    if (! indexes[i] || ! is_key(pair->Get(1))) {
+      free(indexes);
+      ThrowException(Exception::TypeError(String::New("Each term must be [index, key] for an index of the store")));
+      return scope.Close(Undefined());
+    }
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  QueryBaton *baton = new QueryBaton(req, obj);
+  req->data = baton;
+  baton->indexes = indexes;
+  baton->terms = (DBT *) calloc(nterms, sizeof(DBT));
+  baton->nterms = nterms;
+  for (u_int32_t i = 0; i < nterms; ++i) {
+    u_int32_t len;
+    char *data = bound_copy(terms->Get(i)->ToObject()->Get(1), &len);
+    dbt_set(&baton->terms[i], data, len);
+  }
+  if (args[1]->IsNumber() && args[1]->Uint32Value() > 0) {
+    baton->limit = args[1]->Uint32Value();
+  }
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[2]));
+
+  obj->queue(WorkPool::READ, baton, QueryWork, (uv_after_work_cb)ScanAfter);
+
+  return args.This();
+}
+
+static void
+SyncWork(uv_work_t *req) {
+  WorkBaton *baton = (WorkBaton *) req->data;
+
+  DbStore *store = baton->store;
+  baton->call = "sync";
+  baton->ret = store->sync(0);
+}
+
+Handle<Value> DbStore::Sync(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! args[0]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  WorkBaton *baton = new WorkBaton(req, obj);
+  req->data = baton;
+
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+
+  // Writing out the dirty pages can take a while, keep it off the loop
+  obj->queue(WorkPool::WRITE, baton, SyncWork, (uv_after_work_cb)PutAfter);
+
+  return args.This();
+}
+
+
+// Write-behind.  Buffered puts and dels go out in one sorted batch on a
+// writer thread, at most one batch at a time per store.
+struct FlushBaton : public WorkBaton {
+  DBT *dels;
+  u_int32_t ndels;
+
+  FlushBaton(uv_work_t *_r, DbStore *_s) : WorkBaton(_r, _s), dels(0), ndels(0) {}
+  ~FlushBaton() { free(dels); }
+};
+
+static void
+WriteBehindWork(uv_work_t *req) {
+  FlushBaton *baton = (FlushBaton *) req->data;
+
+  DbStore *store = baton->store;
+  bool recno = store->type() == DB_QUEUE || store->type() == DB_RECNO;
+  store->write_buffer()->pack(recno, &baton->inbuf, &baton->bulk,
+                              &baton->dels, &baton->ndels);
+
+  baton->call = "flush";
+  baton->ret = 0;
+  if (baton->inbuf.size) {
+    bulk_encode(store, baton);
+
+    DBT data_dbt;
+    dbt_set(&data_dbt, 0, 0);
+    baton->ret = store->put(NULL, &baton->inbuf, &data_dbt, DB_MULTIPLE_KEY);
+  }
+
+  // Dels of keys that were never written are fine
+  for (u_int32_t i = 0; ! baton->ret && i < baton->ndels; ++i) {
+    int ret = store->del(NULL, &baton->dels[i], 0);
+    if (ret != DB_NOTFOUND) baton->ret = ret;
+  }
+}
+
+// While writes are buffered the timer keeps the loop alive and the store
+// can't be collected
+void
+DbStore::hold_buffer(bool hold)
+{
+  if (hold == _wb_held) return;
+  _wb_held = hold;
+  if (hold) {
+    uv_ref((uv_handle_t *)_wb_timer);
+    Ref();
+  } else {
+    uv_unref((uv_handle_t *)_wb_timer);
+    Unref();
+  }
+}
+
+void
+DbStore::buffered()
+{
+  hold_buffer(true);
+  if (! _wb->flushing() && _wb->bytes() >= _wb_max_bytes) {
+    flush_buffer();
+  }
+}
+
+void
+DbStore::flush_buffer()
+{
+  _wb->start_flush();
+
+  uv_work_t *req = WorkPool::new_req();
+  FlushBaton *baton = new FlushBaton(req, this);
+  req->data = baton;
+
+  WorkPool::queue(WorkPool::WRITE, req, WriteBehindWork, (uv_after_work_cb)BufferFlushed);
+}
+
+void
+DbStore::stop_buffer()
+{
+  if (! _wb) return;
+  uv_timer_stop(_wb_timer);
+  hold_buffer(false);
+  delete _wb;
+  _wb = NULL;
+}
+
+void
+DbStore::BufferTimer(uv_timer_t *timer, int status)
+{
+  DbStore *store = (DbStore *) timer->data;
+  if (store->_wb && ! store->_wb->flushing() && ! store->_wb->empty()) {
+    store->flush_buffer();
+  }
+}
+
+// Answer the flush callbacks waiting so far with err
+static void
+flush_waiters(Persistent<Array> &waiters, Handle<Value> err)
+{
+  if (waiters.IsEmpty()) return;
+  Local<Array> callbacks = Local<Array>::Cast(Local<Value>::New(waiters));
+  waiters.Dispose();
+  waiters.Clear();
+
+  Handle<Value> argv[1] = { err };
+  for (u_int32_t i = 0; i < callbacks->Length(); ++i) {
+    TryCatch try_catch;
+    Local<Function>::Cast(callbacks->Get(i))->Call(Context::GetCurrent()->Global(), 1, argv);
+    if (try_catch.HasCaught())
+      node::FatalException(try_catch);
+  }
+}
+
+void
+DbStore::BufferFlushed(uv_work_t *req, int status)
+{
+  HandleScope scope;
+
+  FlushBaton *baton = (FlushBaton *) req->data;
+  DbStore *store = baton->store;
+  int ret = baton->ret;
+
+  WorkPool::Timing const &t = WorkPool::timing();
+  store->_stats.record(baton->call, t.queued, t.started, t.finished, uv_hrtime());
+  store->_wb->end_flush(ret != 0);
+  delete baton;
+
+  // A failed batch stays buffered for the next flush.  Whoever is
+  // waiting on this one hears about it, a close included.
+  if (ret) {
+    Local<Value> err = node::UVException(0, "flush", db_strerror(ret));
+    flush_waiters(store->_wb_waiters, err);
+    if (store->_pending_close) {
+      WorkBaton *close = store->_pending_close;
+      store->_pending_close = NULL;
+      store->_open = true;
+      store->_closing = false;
+      close->call = "close";
+      close->ret = ret;
+      WorkPool::complete(close->req, (uv_after_work_cb)CloseFailedAfter);
+    }
+    return;
+  }
+
+  // Writes that came in meanwhile go straight out if anyone is waiting
+  // on them, otherwise on the next tick of the timer
+  if (! store->_wb->empty()) {
+    if (! store->_wb_waiters.IsEmpty() || store->_pending_close ||
+        store->_wb->bytes() >= store->_wb_max_bytes) {
+      store->flush_buffer();
+    }
+    return;
+  }
+
+  flush_waiters(store->_wb_waiters, Local<Value>::New(Null()));
+  if (store->_pending_close) {
+    store->maybe_close();
+  } else {
+    store->hold_buffer(false);
+  }
+}
+
+// Call back once everything buffered so far is in the database
+Handle<Value> DbStore::Flush(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! args[0]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (! obj->_wb || (obj->_wb->empty() && ! obj->_wb->flushing())) {
+    uv_work_t *req = WorkPool::new_req();
+    WorkBaton *baton = new WorkBaton(req, obj);
+    req->data = baton;
+    baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    baton->ret = 0;
+    WorkPool::complete(req, (uv_after_work_cb)PutAfter);
+    return args.This();
+  }
+
+  if (obj->_wb_waiters.IsEmpty()) {
+    obj->_wb_waiters = Persistent<Array>::New(Array::New());
+  }
+  Local<Array> callbacks = Local<Array>::Cast(Local<Value>::New(obj->_wb_waiters));
+  callbacks->Set(callbacks->Length(), args[0]);
+
+  if (! obj->_wb->flushing()) obj->flush_buffer();
+
+  return args.This();
+}
+
+// Berkeley DB's own statistics.  Without DB_FAST_STAT, DB->stat walks
+// every page of the database, so it runs on a reader thread.
+struct StatBaton : public WorkBaton {
+  u_int32_t flags;
+  DBTYPE type;
+  void *sp;
+  DB_MPOOL_FSTAT fstat;
+
+  StatBaton(uv_work_t *_r, DbStore *_s) : WorkBaton(_r, _s), flags(0), sp(0) {}
+  ~StatBaton() { free(sp); }
+};
+
+static void
+StatWork(uv_work_t *req) {
+  StatBaton *baton = (StatBaton *) req->data;
+
+  DbStore *store = baton->store;
+  baton->call = "stat";
+  baton->type = store->type();
+  baton->ret = store->stat(&baton->sp, baton->flags);
+  if (! baton->ret) {
+    baton->ret = store->cache_stat(&baton->fstat);
+  }
+}
+
+static void
+set_count(Local<Object> obj, char const *name, double val)
+{
+  obj->Set(String::NewSymbol(name), Number::New(val));
+}
+
+// The fraction of a set of pages in use, from the bytes free on them
+static double
+fill(double pages, u_int32_t pagesize, double bytes_free)
+{
+  if (! pages || ! pagesize) return 0;
+  return 1 - bytes_free / (pages * pagesize);
+}
+
+static Local<Object>
+stat_object(StatBaton *baton)
+{
+  Local<Object> stats = Object::New();
+  switch (baton->type) {
+  case DB_BTREE:
+  case DB_RECNO: {
+    DB_BTREE_STAT *sp = (DB_BTREE_STAT *) baton->sp;
+    set_count(stats, "keys", sp->bt_nkeys);
+    set_count(stats, "records", sp->bt_ndata);
+    set_count(stats, "pageSize", sp->bt_pagesize);
+    set_count(stats, "pages", sp->bt_pagecnt);
+    set_count(stats, "levels", sp->bt_levels);
+    set_count(stats, "internalPages", sp->bt_int_pg);
+    set_count(stats, "leafPages", sp->bt_leaf_pg);
+    set_count(stats, "duplicatePages", sp->bt_dup_pg);
+    set_count(stats, "overflowPages", sp->bt_over_pg);
+    set_count(stats, "emptyPages", sp->bt_empty_pg);
+    set_count(stats, "freePages", sp->bt_free);
+    set_count(stats, "internalFill", fill(sp->bt_int_pg, sp->bt_pagesize, sp->bt_int_pgfree));
+    set_count(stats, "leafFill", fill(sp->bt_leaf_pg, sp->bt_pagesize, sp->bt_leaf_pgfree));
+    set_count(stats, "overflowFill", fill(sp->bt_over_pg, sp->bt_pagesize, sp->bt_over_pgfree));
+    break;
+  }
+  case DB_HASH: {
+    DB_HASH_STAT *sp = (DB_HASH_STAT *) baton->sp;
+    set_count(stats, "keys", sp->hash_nkeys);
+    set_count(stats, "records", sp->hash_ndata);
+    set_count(stats, "pageSize", sp->hash_pagesize);
+    set_count(stats, "pages", sp->hash_pagecnt);
+    set_count(stats, "fillFactor", sp->hash_ffactor);
+    set_count(stats, "buckets", sp->hash_buckets);
+    set_count(stats, "freePages", sp->hash_free);
+    set_count(stats, "bigPages", sp->hash_bigpages);
+    set_count(stats, "overflowPages", sp->hash_overflows);
+    set_count(stats, "duplicatePages", sp->hash_dup);
+    set_count(stats, "bucketFill", fill(sp->hash_buckets, sp->hash_pagesize, sp->hash_bfree));
+    set_count(stats, "overflowFill", fill(sp->hash_overflows, sp->hash_pagesize, sp->hash_ovfl_free));
+    break;
+  }
+  case DB_HEAP: {
+    DB_HEAP_STAT *sp = (DB_HEAP_STAT *) baton->sp;
+    set_count(stats, "records", sp->heap_nrecs);
+    set_count(stats, "pageSize", sp->heap_pagesize);
+    set_count(stats, "pages", sp->heap_pagecnt);
+    set_count(stats, "regions", sp->heap_nregions);
+    set_count(stats, "regionSize", sp->heap_regionsize);
+    break;
+  }
+  case DB_QUEUE: {
+    DB_QUEUE_STAT *sp = (DB_QUEUE_STAT *) baton->sp;
+    set_count(stats, "keys", sp->qs_nkeys);
+    set_count(stats, "records", sp->qs_ndata);
+    set_count(stats, "pageSize", sp->qs_pagesize);
+    set_count(stats, "pages", sp->qs_pages);
+    set_count(stats, "extentSize", sp->qs_extentsize);
+    set_count(stats, "recordLength", sp->qs_re_len);
+    set_count(stats, "firstRecno", sp->qs_first_recno);
+    set_count(stats, "currentRecno", sp->qs_cur_recno);
+    set_count(stats, "pageFill", fill(sp->qs_pages, sp->qs_pagesize, sp->qs_pgfree));
+    break;
+  }
+  default:
+    break;
+  }
+
+  // Requests for this file's pages in the cache
+  DB_MPOOL_FSTAT *fs = &baton->fstat;
+  Local<Object> cache = Object::New();
+  set_count(cache, "hits", fs->st_cache_hit);
+  set_count(cache, "misses", fs->st_cache_miss);
+  double requests = (double) fs->st_cache_hit + fs->st_cache_miss;
+  set_count(cache, "hitRatio", requests ? fs->st_cache_hit / requests : 0);
+  set_count(cache, "pagesCreated", fs->st_page_create);
+  set_count(cache, "pagesRead", fs->st_page_in);
+  set_count(cache, "pagesWritten", fs->st_page_out);
+  stats->Set(String::NewSymbol("cache"), cache);
+
+  return stats;
+}
+
+static void
+StatAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  StatBaton *baton = (StatBaton *)req->data;
+
+  Handle<Value> argv[2];
+  if (baton->ret) {
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    argv[1] = stat_object(baton);
+  }
+  After(baton, argv, 2);
+}
+
+Handle<Value> DbStore::Stat(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  int cb_arg = args[0]->IsFunction() ? 0 : 1;
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (! obj->_open) {
+    ThrowException(Exception::Error(String::New("DbStore is not open")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  StatBaton *baton = new StatBaton(req, obj);
+  req->data = baton;
+
+  // fast: only what is kept in the metadata page, without the page walk
+  if (cb_arg == 1 && args[0]->IsObject() &&
+      args[0]->ToObject()->Get(String::NewSymbol("fast"))->BooleanValue()) {
+    baton->flags |= DB_FAST_STAT;
+  }
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  obj->queue(WorkPool::READ, baton, StatWork, (uv_after_work_cb)StatAfter);
+
+  return args.This();
+}
+
+// Expiry.  Records of a ttl store are read as missing once they expire,
+// and the timer deletes them in batches through the expiry index, oldest
+// first, on a writer thread.
+
+struct SweepBaton : public WorkBaton {
+  u_int32_t swept;
+
+  SweepBaton(uv_work_t *_r, DbStore *_s) : WorkBaton(_r, _s), swept(0) {}
+};
+
+static void
+SweepWork(uv_work_t *req) {
+  SweepBaton *baton = (SweepBaton *) req->data;
+
+  DbStore *store = baton->store;
+  baton->call = "sweep";
+  baton->ret = store->sweep(Ttl::now(), baton->count, &baton->swept);
+}
+
+void
+DbStore::sweep_now()
+{
+  uv_work_t *req = WorkPool::new_req();
+  SweepBaton *baton = new SweepBaton(req, this);
+  req->data = baton;
+  baton->count = _sweep_batch;
+
+  // Pinned until the batch is done, close waits for it
+  _sweep_busy = true;
+  Ref();
+  WorkPool::queue(WorkPool::WRITE, req, SweepWork, (uv_after_work_cb)SweepAfter);
+}
+
+void
+DbStore::stop_sweep()
+{
+  if (_sweep_timer) uv_timer_stop(_sweep_timer);
+}
+
+void
+DbStore::SweepTimer(uv_timer_t *timer, int status)
+{
+  DbStore *store = (DbStore *) timer->data;
+  if (store->_ttl && ! store->_sweep_busy && ! store->_pending_close) {
+    store->sweep_now();
+  }
+}
+
+void
+DbStore::SweepAfter(uv_work_t *req, int status)
+{
+  HandleScope scope;
+
+  SweepBaton *baton = (SweepBaton *) req->data;
+  DbStore *store = baton->store;
+
+  WorkPool::Timing const &t = WorkPool::timing();
+  store->_stats.record(baton->call, t.queued, t.started, t.finished, uv_hrtime());
+  store->_sweep_runs++;
+  store->_swept += baton->swept;
+
+  // A full batch means there is likely more, carry on without waiting
+  // for the timer.  Errors wait for the next tick.
+  bool more = ! baton->ret && baton->swept && baton->swept == baton->count;
+  delete baton;
+
+  store->_sweep_busy = false;
+  if (more && ! store->_pending_close) {
+    store->sweep_now();
+  } else {
+    store->maybe_close();
+  }
+  store->Unref();
+}
+
+// Sweeps run and records they deleted
+Handle<Value> DbStore::SweepStats(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  if (! obj->_ttl) {
+    return scope.Close(Undefined());
+  }
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("runs"), Number::New(obj->_sweep_runs));
+  stats->Set(String::NewSymbol("expired"), Number::New(obj->_swept));
+  return scope.Close(stats);
+}
+
+// Compaction.  DB->compact runs online, merging sparse pages and giving
+// empty ones back, in slices on a writer thread so other writes get a
+// turn in between.  A slice ends once it has freed COMPACT_SLICE pages,
+// and the next carries on from the key it stopped before.
+
+static u_int32_t const COMPACT_SLICE = 64;
+
+struct CompactBaton : public WorkBaton {
+  DB_COMPACT c_data;       // the last slice's counts
+  u_int32_t flags;
+  u_int32_t fillpercent;
+  u_int32_t max_pages;     // 0 for no limit
+  uint64_t deadline;       // uv_hrtime(), 0 for none
+  DBT start;               // where the next slice begins, empty at first
+  u_int32_t slice;         // pages the slice may free
+  bool done;
+
+  // Totals over the slices so far
+  u_int32_t slices;
+  u_int32_t pages;
+  double examined;
+  double freed;
+  double truncated;
+  double levels;
+  double deadlocks;
+  double empty_buckets;
+
+  CompactBaton(uv_work_t *_r, DbStore *_s)
+    : WorkBaton(_r, _s), flags(0), fillpercent(0), max_pages(0), deadline(0),
+      slice(0), done(false), slices(0), pages(0), examined(0), freed(0),
+      truncated(0), levels(0), deadlocks(0), empty_buckets(0) {
+    memset(&start, 0, sizeof(start));
+  }
+  ~CompactBaton() { free(start.data); }
+};
+
+static void
+CompactWork(uv_work_t *req) {
+  CompactBaton *baton = (CompactBaton *) req->data;
+
+  DbStore *store = baton->store;
+  baton->call = "compact";
+
+  memset(&baton->c_data, 0, sizeof(baton->c_data));
+  baton->c_data.compact_fillpercent = baton->fillpercent;
+  baton->c_data.compact_pages = baton->slice;
+
+  DBT end;
+  dbt_set(&end, 0, 0, DB_DBT_MALLOC);
+  baton->ret = store->compact(baton->start.size ? &baton->start : NULL,
+                              &baton->c_data, baton->flags, &end);
+  if (baton->ret) {
+    free(end.data);
+    return;
+  }
+
+  // BDB stops early only at the end of the file.  Partitions each
+  // start over from the beginning, so a partitioned store goes in one.
+  baton->done = ! baton->slice || baton->c_data.compact_pages != 0 || ! end.size;
+  free(baton->start.data);
+  baton->start = end;
+}
+
+static Local<Object>
+compact_object(CompactBaton *baton)
+{
+  Local<Object> result = Object::New();
+  set_count(result, "slices", baton->slices);
+  set_count(result, "pagesExamined", baton->examined);
+  set_count(result, "pagesFreed", baton->freed);
+  set_count(result, "pagesTruncated", baton->truncated);
+  set_count(result, "levels", baton->levels);
+  set_count(result, "deadlocks", baton->deadlocks);
+  if (baton->store->type() == DB_HASH) {
+    set_count(result, "emptyBuckets", baton->empty_buckets);
+  }
+  result->Set(String::NewSymbol("done"), Boolean::New(baton->done));
+  return result;
+}
+
+// Size the next slice, false if the budget is spent
+static bool
+compact_slice(CompactBaton *baton)
+{
+  if (baton->deadline && uv_hrtime() >= baton->deadline) return false;
+  if (baton->store->parts()) {
+    baton->slice = 0;
+    return true;
+  }
+  baton->slice = COMPACT_SLICE;
+  if (baton->max_pages) {
+    if (baton->pages >= baton->max_pages) return false;
+    if (baton->max_pages - baton->pages < baton->slice) {
+      baton->slice = baton->max_pages - baton->pages;
+    }
+  }
+  return true;
+}
+
+void
+DbStore::CompactAfter(uv_work_t *req, int status)
+{
+  HandleScope scope;
+
+  CompactBaton *baton = (CompactBaton *) req->data;
+  DbStore *store = baton->store;
+
+  if (! baton->ret) {
+    DB_COMPACT const &c = baton->c_data;
+    baton->slices++;
+    if (baton->slice) baton->pages += baton->slice - c.compact_pages;
+    baton->examined += c.compact_pages_examine;
+    baton->freed += c.compact_pages_free;
+    baton->truncated += c.compact_pages_truncated;
+    baton->levels += c.compact_levels;
+    baton->deadlocks += c.compact_deadlock;
+    baton->empty_buckets += c.compact_empty_buckets;
+  }
+
+  // A close stops compaction between slices, the totals say how far
+  // it got
+  if (! baton->ret && ! baton->done && ! store->_pending_close &&
+      compact_slice(baton)) {
+    WorkPool::Timing const &t = WorkPool::timing();
+    store->_stats.record(baton->call, t.queued, t.started, t.finished, uv_hrtime());
+    WorkPool::queue(WorkPool::WRITE, req, CompactWork, (uv_after_work_cb)CompactAfter);
+    return;
+  }
+
+  Handle<Value> argv[2];
+  if (baton->ret) {
+    argv[1] = Local<Value>::New(Undefined());
+  } else {
+    argv[1] = compact_object(baton);
+  }
+  store->_compacting = false;
+  After(baton, argv, 2);
+
+  store->maybe_close();
+  store->Unref();
+}
+
+// compact([opts], cb): opts.maxPages bounds the pages freed and
+// opts.timeoutMs the time taken, checked between slices
+Handle<Value> DbStore::Compact(const Arguments& args) {
+  HandleScope scope;
+
+  DbStore* obj = ObjectWrap::Unwrap<DbStore>(args.This());
+
+  int cb_arg = args[0]->IsFunction() ? 0 : 1;
+  if (! args[cb_arg]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Last argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  if (! obj->_open) {
+    ThrowException(Exception::Error(String::New("DbStore is not open")));
+    return scope.Close(Undefined());
+  }
+  if (obj->_type != DB_BTREE && obj->_type != DB_RECNO && obj->_type != DB_HASH) {
+    ThrowException(Exception::Error(String::New("Only btree, recno and hash stores can be compacted")));
+    return scope.Close(Undefined());
+  }
+  if (obj->_compacting) {
+    ThrowException(Exception::Error(String::New("DbStore is already compacting")));
+    return scope.Close(Undefined());
+  }
+  // DB->compact moves and frees pages under page locks.  Without them,
+  // in a store of its own, readers on other threads walk the tree as it
+  // changes, and Concurrent Data Store locking doesn't cover it either.
+  u_int32_t env_flags = 0;
+  if (! obj->_env || obj->_env->get_open_flags(obj->_env, &env_flags) ||
+      ! (env_flags & DB_INIT_LOCK)) {
+    ThrowException(Exception::Error(String::New("Compaction needs a store in a transactional DbEnv")));
+    return scope.Close(Undefined());
+  }
+
+  u_int32_t max_pages = 0, timeout = 0, fillpercent = 0, flags = 0;
+  if (cb_arg == 1 && args[0]->IsObject()) {
+    Local<Object> opts = args[0]->ToObject();
+    max_pages = uint_opt(opts, "maxPages");
+    timeout = uint_opt(opts, "timeoutMs");
+    fillpercent = uint_opt(opts, "fillPercent");
+    if (fillpercent > 100) {
+      ThrowException(Exception::TypeError(String::New("fillPercent must be from 1 to 100")));
+      return scope.Close(Undefined());
+    }
+    // Free pages at the end of the file go back to the filesystem
+    if (opts->Get(String::NewSymbol("freeSpace"))->BooleanValue()) {
+      flags |= DB_FREE_SPACE;
+    }
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  CompactBaton *baton = new CompactBaton(req, obj);
+  req->data = baton;
+  baton->flags = flags;
+  baton->fillpercent = fillpercent;
+  baton->max_pages = max_pages;
+  if (timeout) baton->deadline = uv_hrtime() + (uint64_t) timeout * 1000000;
+  compact_slice(baton);
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[cb_arg]));
+
+  // Pinned until the last slice is done, close waits for it
+  obj->_compacting = true;
+  obj->Ref();
+  WorkPool::queue(WorkPool::WRITE, req, CompactWork, (uv_after_work_cb)CompactAfter);
+
+  return args.This();
+}
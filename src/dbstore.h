@@ -5,26 +5,181 @@
 
 #include <db.h>
 
+#include "codec.h"
+#include "opstats.h"
+#include "workpool.h"
+
+// Access method and its sizing, chosen when a store is created.  Zero
+// leaves the BDB default.
+struct DbStoreOptions {
+  DBTYPE type;
+  u_int32_t pagesize;
+  u_int32_t h_ffactor;     // hash
+  u_int32_t h_nelem;       // hash
+  u_int32_t q_extentsize;  // queue
+  u_int32_t re_len;        // queue and recno
+  int re_pad;              // queue and recno, -1 for default
+  bool bt_compress;        // btree, prefix compression within pages
+  bool ttl;                // values carry an expiry, indexed in <file>.expires
+  u_int32_t parts;         // btree and hash, files the records are spread over
+  DBT *part_keys;          // the parts - 1 lowest keys of all but the first
+                           // partition, NULL to partition by key hash
+  char const **part_dirs;  // where the partitions go, NULL terminated
+
+  DbStoreOptions()
+    : type(DB_BTREE), pagesize(0), h_ffactor(0), h_nelem(0),
+      q_extentsize(0), re_len(0), re_pad(-1), bt_compress(false), ttl(false),
+      parts(0), part_keys(0), part_dirs(0) {}
+};
+
+struct WorkBaton;
+class ValueCache;
+class WriteBuffer;
+class Extractor;
+class DbStore;
+class DbEnv;
+
+// A secondary index of a store opened with indexes, kept in a file of its
+// own, <file>.<name>.index, and maintained by BDB on every write
+struct DbIndex {
+  char *name;
+  Extractor *extractor;
+  DbStore *store;
+  DB *db;
+};
+
 class DbStore : public node::ObjectWrap {
  public:
   static void Init(v8::Handle<v8::Object> target);
 
-  int open(char const *fname, char const *db, DBTYPE type, u_int32_t flags, int mode);
+  int open(char const *fname, char const *db, DbStoreOptions const &opts,
+           u_int32_t flags, int mode);
   int close();
 
-  int put(DBT *key, DBT *data, u_int32_t flags);
-  int get(DBT *key, DBT *data, u_int32_t flags);
-  int del(DBT *key, u_int32_t flags);
+  int put(DB_TXN *txn, DBT *key, DBT *data, u_int32_t flags);
+  int get(DB_TXN *txn, DBT *key, DBT *data, u_int32_t flags);
+  int del(DB_TXN *txn, DBT *key, u_int32_t flags);
+
+  int cursor(DBC **dbc, u_int32_t flags);
+  // A join cursor over the records in every one of the index cursors
+  int join(DBC **curslist, DBC **dbcp);
+  u_int32_t pagesize();
+  DBTYPE type() const { return _type; }
 
   int sync(u_int32_t flags);
 
+  // Delete up to max records that expired by now, oldest first
+  int sweep(u_int32_t now, u_int32_t max, u_int32_t *count);
+
+  // DB->compact from start, NULL for the beginning, leaving end at the
+  // key it stopped before
+  int compact(DBT *start, DB_COMPACT *c_data, u_int32_t flags, DBT *end);
+  // Files the records are spread over, 0 unless partitioned
+  u_int32_t parts() const { return _parts; }
+
+  // DB->stat, sp is the type's DB_*_STAT, to be freed
+  int stat(void *sp, u_int32_t flags);
+  // This file's cache counters, zero if it has no pages cached
+  int cache_stat(DB_MPOOL_FSTAT *fstat);
+
+  // Gets in flight, so concurrent gets of one key share a lookup
+  WorkBaton *find_get(void const *key, u_int32_t len);
+  void add_get(WorkBaton *baton);
+  void forget_get(void const *key, u_int32_t len);
+  void forget_gets();
+
+  ValueCache *cache() { return _cache; }
+
+  Codec::Type codec() const { return _codec; }
+  u_int32_t codec_threshold() const { return _codec_threshold; }
+
+  bool ttl() const { return _ttl; }
+
+  DbIndex *index(char const *name);
+
+  // A write to key is queued or done, drop anything read before it
+  void invalidate(void const *key, u_int32_t len);
+
+  WriteBuffer *write_buffer() { return _wb; }
+
+  OpStats &op_stats() { return _stats; }
+
+  // WorkPool::queue for the baton's work, counted as in flight
+  void queue(WorkPool::Queue q, WorkBaton *baton, uv_work_cb work, uv_after_work_cb after);
+
  private:
   DbStore();
   ~DbStore();
 
   DB *_db;
+  DB *_expiry;      // secondary index of expiry times, for ttl stores
+  DbIndex *_indexes;
+  u_int32_t _nindexes;
   DB_ENV *_env;
-  DB_TXN *_txn;
+  DBTYPE _type;
+  u_int32_t _parts;
+  bool _open;       // set on the loop thread once open succeeds, cleared
+                    // by close
+  bool _closing;    // close called and its callback not yet run
+
+  v8::Persistent<v8::Object> _env_obj; // Keeps a shared DbEnv alive
+  DbEnv *_dbenv;                       // counts this store until it closes
+
+  void detach_env();
+
+  static int const GET_BUCKETS = 64;
+  WorkBaton *_gets[GET_BUCKETS];
+
+  ValueCache *_cache;   // NULL unless opened with valueCache
+
+  OpStats _stats;
+
+  Codec::Type _codec;
+  u_int32_t _codec_threshold;
+
+  WorkBaton *_pending_close;  // close waiting for flushes, sweeps and
+                              // compaction
+  bool _compacting;           // a compaction's slices are running
+  u_int32_t _in_flight;       // work queued through queue() and not done
+
+  void maybe_close();
+  void free_indexes();
+
+  // Write-behind: puts and dels wait in _wb until the timer or size
+  // limit flushes them
+  WriteBuffer *_wb;
+  uv_timer_t *_wb_timer;
+  size_t _wb_max_bytes;
+  v8::Persistent<v8::Array> _wb_waiters;  // flush callbacks
+  bool _wb_held;                          // timer ref'd and object pinned
+
+  void buffered();
+  void hold_buffer(bool hold);
+  void flush_buffer();
+  void stop_buffer();
+
+  static void BufferTimer(uv_timer_t *timer, int status);
+  static void BufferFlushed(uv_work_t *req, int status);
+
+  // Expiry: a timer sweeps expired records in batches on a writer thread
+  bool _ttl;
+  uv_timer_t *_sweep_timer;
+  bool _sweep_busy;
+  u_int32_t _sweep_batch;
+  u_int64_t _sweep_runs;
+  u_int64_t _swept;
+
+  void sweep_now();
+  void stop_sweep();
+
+  static void SweepTimer(uv_timer_t *timer, int status);
+  static void SweepAfter(uv_work_t *req, int status);
+
+  static void OpenAfter(uv_work_t *req, int status);
+  static void CompactAfter(uv_work_t *req, int status);
+  static void CloseAfter(uv_work_t *req, int status);
+
+  static void StoreAfter(uv_work_t *req, int status);
 
   static v8::Handle<v8::Value> New(const v8::Arguments& args);
 
@@ -32,10 +187,24 @@ class DbStore : public node::ObjectWrap {
   static v8::Handle<v8::Value> Close(const v8::Arguments& args);
 
   static v8::Handle<v8::Value> Get(const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetSync(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Cached(const v8::Arguments& args);
+  static v8::Handle<v8::Value> CacheStats(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Stats(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Stat(const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetMany(const v8::Arguments& args);
   static v8::Handle<v8::Value> Put(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Append(const v8::Arguments& args);
+  static v8::Handle<v8::Value> PutMany(const v8::Arguments& args);
   static v8::Handle<v8::Value> Del(const v8::Arguments& args);
 
+  static v8::Handle<v8::Value> Scan(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Query(const v8::Arguments& args);
+
   static v8::Handle<v8::Value> Sync(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Flush(const v8::Arguments& args);
+  static v8::Handle<v8::Value> SweepStats(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Compact(const v8::Arguments& args);
 };
 
 #endif
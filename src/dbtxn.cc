@@ -0,0 +1,269 @@
+#include <node.h>
+
+#include "dbtxn.h"
+#include "dbenv.h"
+#include "workpool.h"
+
+#include <cstdlib>
+
+using namespace v8;
+
+Persistent<FunctionTemplate> DbTxn::constructor_template;
+
+// A job queued on a transaction, run in place of the caller's req
+struct TxnOp {
+  uv_work_t *req;       // ours, queued on the pool
+  uv_work_t *inner;     // the caller's
+  WorkPool::Queue q;
+  uv_work_cb work;
+  uv_after_work_cb after;
+  DbTxn *txn;
+  TxnOp *next;
+};
+
+DbTxn::DbTxn()
+  : _txn(0), _dbenv(0), _env_prev(0), _env_next(0), _listed(false),
+    _head(0), _tail(0), _pending(0) {};
+DbTxn::~DbTxn() {
+  // Never committed, so never happened.  A closed environment has
+  // already aborted it and cleared _txn.
+  if (_txn) _txn->abort(_txn);
+  if (_listed) _dbenv->remove_txn(this);
+  _env_obj.Dispose();
+};
+
+void DbTxn::Init(Handle<Object> target) {
+  // Prepare constructor template
+  Local<FunctionTemplate> tpl = FunctionTemplate::New(New);
+  tpl->SetClassName(String::NewSymbol("DbTxn"));
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  // Prototype
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("commit"),
+      FunctionTemplate::New(Commit)->GetFunction());
+  tpl->PrototypeTemplate()->Set(String::NewSymbol("abort"),
+      FunctionTemplate::New(Abort)->GetFunction());
+
+  constructor_template = Persistent<FunctionTemplate>::New(tpl);
+  Persistent<Function> constructor = Persistent<Function>::New(tpl->GetFunction());
+  target->Set(String::NewSymbol("DbTxn"), constructor);
+}
+
+bool DbTxn::HasInstance(Handle<Value> val) {
+  return val->IsObject() && constructor_template->HasInstance(val);
+}
+
+Handle<Value> DbTxn::New(const Arguments& args) {
+  HandleScope scope;
+
+  DbTxn* obj = new DbTxn();
+  obj->Wrap(args.This());
+
+  return args.This();
+}
+
+Handle<Value> DbTxn::NewInstance(Handle<Object> env, u_int32_t flags) {
+  HandleScope scope;
+
+  DbEnv *dbenv = ObjectWrap::Unwrap<DbEnv>(env);
+
+  Local<Object> instance = constructor_template->GetFunction()->NewInstance();
+  DbTxn *obj = ObjectWrap::Unwrap<DbTxn>(instance);
+
+  int ret = dbenv->txn_begin(&obj->_txn, flags);
+  if (ret) {
+    obj->_txn = NULL;
+    ThrowException(node::UVException(0, "begin", db_strerror(ret)));
+    return scope.Close(Undefined());
+  }
+  obj->_dbenv = dbenv;
+  obj->_env_obj = Persistent<Object>::New(env);
+  dbenv->add_txn(obj);
+
+  return scope.Close(instance);
+}
+
+void
+DbTxn::queue(WorkPool::Queue q, uv_work_t *req, uv_work_cb work, uv_after_work_cb after)
+{
+  TxnOp *op = (TxnOp *) Recycler<sizeof(TxnOp)>::get();
+  op->req = WorkPool::new_req();
+  op->req->data = op;
+  op->inner = req;
+  op->q = q;
+  op->work = work;
+  op->after = after;
+  op->txn = this;
+  op->next = NULL;
+
+  // Pinned while it has work, the last after callback may drop the
+  // only other reference
+  if (_pending++ == 0) Ref();
+
+  if (_tail) {
+    _tail->next = op;
+    _tail = op;
+    return;
+  }
+  _head = _tail = op;
+  run_next();
+}
+
+void
+DbTxn::run_next()
+{
+  if (_head) {
+    WorkPool::queue(_head->q, _head->req, OpWork, OpAfter);
+  }
+}
+
+void
+DbTxn::OpWork(uv_work_t *req)
+{
+  TxnOp *op = (TxnOp *) req->data;
+  op->work(op->inner);
+}
+
+void
+DbTxn::OpAfter(uv_work_t *req, int status)
+{
+  TxnOp *op = (TxnOp *) req->data;
+  DbTxn *txn = op->txn;
+
+  txn->_head = op->next;
+  if (! txn->_head) txn->_tail = NULL;
+
+  // Anything the callback queues goes behind what is already waiting
+  op->after(op->inner, status);
+
+  WorkPool::free_req(op->req);
+  Recycler<sizeof(TxnOp)>::put(op);
+
+  txn->run_next();
+  if (--txn->_pending == 0) txn->Unref();
+}
+
+struct TxnBaton {
+  uv_work_t *req;
+  DbTxn *obj;
+  DB_TXN *txn;
+  DbEnv *dbenv;
+  bool commit;
+  bool grouped;   // log flush is left to the environment's group commit
+
+  Persistent<Value> txnobj;
+  Persistent<Function> callback;
+
+  char const *call;
+  int ret;
+
+  TxnBaton(uv_work_t *_r, DbTxn *_o, DB_TXN *_t, DbEnv *_e);
+  ~TxnBaton();
+};
+
+TxnBaton::TxnBaton(uv_work_t *_r, DbTxn *_o, DB_TXN *_t, DbEnv *_e)
+  : req(_r), obj(_o), txn(_t), dbenv(_e), commit(true), grouped(false) {
+}
+TxnBaton::~TxnBaton() {
+  WorkPool::free_req(req);
+
+  txnobj.Dispose();
+  callback.Dispose();
+}
+
+static void
+TxnWork(uv_work_t *req) {
+  TxnBaton *baton = (TxnBaton *) req->data;
+
+  if (baton->commit) {
+    // With group commit the record is written but not flushed, the
+    // environment flushes the log once for everything in the window.
+    baton->call = "commit";
+    baton->ret = baton->txn->commit(baton->txn, baton->grouped ? DB_TXN_NOSYNC : 0);
+  } else {
+    baton->call = "abort";
+    baton->ret = baton->txn->abort(baton->txn);
+  }
+}
+
+static void
+TxnAfter(uv_work_t *req, int status) {
+  HandleScope scope;
+
+  // fetch our data structure
+  TxnBaton *baton = (TxnBaton *)req->data;
+
+  // Finished one way or the other, the environment can close
+  baton->dbenv->remove_txn(baton->obj);
+
+  if (baton->grouped && ! baton->ret) {
+    // The callback runs once the shared log flush is done
+    baton->dbenv->queue_flush(baton->callback);
+    baton->callback.Clear();
+    delete baton;
+    return;
+  }
+
+  // create an arguments array for the callback
+  Handle<Value> argv[1];
+  if (baton->ret) {
+    argv[0] = node::UVException(0, baton->call, db_strerror(baton->ret));
+  } else {
+    argv[0] = Local<Value>::New(Null());
+  }
+
+  // surround in a try/catch for safety
+  TryCatch try_catch;
+
+  // execute the callback function
+  baton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+  if (try_catch.HasCaught())
+    node::FatalException(try_catch);
+
+  delete baton;
+}
+
+Handle<Value> DbTxn::Finish(const Arguments& args, bool commit) {
+  HandleScope scope;
+
+  DbTxn* obj = ObjectWrap::Unwrap<DbTxn>(args.This());
+
+  if (! args[0]->IsFunction()) {
+    ThrowException(Exception::TypeError(String::New("Argument must be callback function")));
+    return scope.Close(Undefined());
+  }
+
+  DB_TXN *txn = obj->txn();
+  if (! txn) {
+    ThrowException(Exception::Error(String::New("Transaction has already finished")));
+    return scope.Close(Undefined());
+  }
+
+  // create an async work token
+  uv_work_t *req = WorkPool::new_req();
+
+  // assign our data structure that will be passed around
+  TxnBaton *baton = new TxnBaton(req, obj, txn, obj->_dbenv);
+  req->data = baton;
+
+  baton->commit = commit;
+  baton->grouped = commit && obj->_dbenv->group_commit() > 0;
+  baton->txnobj = Persistent<Value>::New(args.This());
+  baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+
+  // The handle is gone once commit or abort is called, whatever the
+  // result.  It runs after the operations already queued in it.
+  obj->_txn = NULL;
+
+  obj->queue(WorkPool::WRITE, req, TxnWork, (uv_after_work_cb)TxnAfter);
+
+  return args.This();
+}
+
+Handle<Value> DbTxn::Commit(const Arguments& args) {
+  return Finish(args, true);
+}
+
+Handle<Value> DbTxn::Abort(const Arguments& args) {
+  return Finish(args, false);
+}
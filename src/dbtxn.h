@@ -0,0 +1,66 @@
+#ifndef DBTXN_H
+#define DBTXN_H
+
+#include <node.h>
+
+#include <db.h>
+
+#include "workpool.h"
+
+class DbEnv;
+struct TxnOp;
+
+class DbTxn : public node::ObjectWrap {
+ public:
+  static void Init(v8::Handle<v8::Object> target);
+  static bool HasInstance(v8::Handle<v8::Value> val);
+
+  // Begin a transaction in the DbEnv wrapped by env
+  static v8::Handle<v8::Value> NewInstance(v8::Handle<v8::Object> env, u_int32_t flags);
+
+  // NULL once the transaction has been committed or aborted
+  DB_TXN *txn() { return _txn; }
+
+  // Same contract as WorkPool::queue, for work using this transaction.
+  // BDB lets only one thread use a DB_TXN at a time, so the jobs run one
+  // after another in the order they were queued, whichever queue they
+  // are on, and a commit or abort runs once everything before it is done.
+  void queue(WorkPool::Queue q, uv_work_t *req, uv_work_cb work, uv_after_work_cb after);
+
+  // Jobs queued and not yet completed, commit and abort included
+  u_int32_t pending() const { return _pending; }
+
+ private:
+  friend class DbEnv;
+
+  DbTxn();
+  ~DbTxn();
+
+  DB_TXN *_txn;
+  DbEnv *_dbenv;
+  v8::Persistent<v8::Object> _env_obj; // Keeps the DbEnv alive
+
+  // The environment's list of transactions it hasn't seen finish
+  DbTxn *_env_prev;
+  DbTxn *_env_next;
+  bool _listed;
+
+  TxnOp *_head;       // the running job, then those waiting on it
+  TxnOp *_tail;
+  u_int32_t _pending;
+
+  void run_next();
+
+  static void OpWork(uv_work_t *req);
+  static void OpAfter(uv_work_t *req, int status);
+
+  static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
+  static v8::Handle<v8::Value> New(const v8::Arguments& args);
+
+  static v8::Handle<v8::Value> Finish(const v8::Arguments& args, bool commit);
+  static v8::Handle<v8::Value> Commit(const v8::Arguments& args);
+  static v8::Handle<v8::Value> Abort(const v8::Arguments& args);
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "extractor.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace v8;
+
+Extractor::Extractor(Kind kind)
+  : _kind(kind), _offset(0), _length(0), _field(0), _delimiter(','), _path(0) {
+}
+
+Extractor::~Extractor() {
+  free(_path);
+}
+
+Extractor *
+Extractor::New(Handle<Object> spec)
+{
+  HandleScope scope;
+
+  Local<Value> path = spec->Get(String::NewSymbol("path"));
+  if (path->IsString()) {
+    String::Utf8Value str(path);
+    if (! str.length()) return NULL;
+    Extractor *ex = new Extractor(JSON);
+    ex->_path = strdup(*str);
+    return ex;
+  }
+
+  Local<Value> field = spec->Get(String::NewSymbol("field"));
+  if (field->IsNumber()) {
+    Extractor *ex = new Extractor(FIELD);
+    ex->_field = field->Uint32Value();
+    Local<Value> delimiter = spec->Get(String::NewSymbol("delimiter"));
+    if (! delimiter->IsUndefined()) {
+      String::Utf8Value str(delimiter);
+      if (str.length() != 1) {
+        delete ex;
+        return NULL;
+      }
+      ex->_delimiter = (*str)[0];
+    }
+    return ex;
+  }
+
+  Local<Value> offset = spec->Get(String::NewSymbol("offset"));
+  Local<Value> length = spec->Get(String::NewSymbol("length"));
+  if (offset->IsNumber() || length->IsNumber()) {
+    Extractor *ex = new Extractor(BYTES);
+    if (offset->IsNumber()) ex->_offset = offset->Uint32Value();
+    if (length->IsNumber()) ex->_length = length->Uint32Value();
+    return ex;
+  }
+
+  return NULL;
+}
+
+bool
+Extractor::extract(char const *data, u_int32_t len,
+                   char const **key, u_int32_t *klen) const
+{
+  switch (_kind) {
+  case BYTES: return bytes(data, len, key, klen);
+  case FIELD: return field(data, len, key, klen);
+  default: return json(data, len, key, klen);
+  }
+}
+
+bool
+Extractor::bytes(char const *data, u_int32_t len,
+                 char const **key, u_int32_t *klen) const
+{
+  if (_offset >= len) return false;
+  *key = data + _offset;
+  *klen = len - _offset;
+  if (_length && _length < *klen) *klen = _length;
+  return true;
+}
+
+bool
+Extractor::field(char const *data, u_int32_t len,
+                 char const **key, u_int32_t *klen) const
+{
+  char const *p = data, *end = data + len;
+  for (u_int32_t i = 0; i < _field; ++i) {
+    p = (char const *) memchr(p, _delimiter, end - p);
+    if (! p) return false;
+    ++p;
+  }
+  char const *stop = (char const *) memchr(p, _delimiter, end - p);
+  *key = p;
+  *klen = (stop ? stop : end) - p;
+  return true;
+}
+
+// Just enough JSON to find a member: values are skipped over rather than
+// parsed, and anything malformed simply isn't indexed.
+
+static char const *
+skip_ws(char const *p, char const *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+  return p;
+}
+
+// Past the string whose opening quote is at p, NULL if it never closes
+static char const *
+skip_string(char const *p, char const *end)
+{
+  for (++p; p < end; ++p) {
+    if (*p == '\\') ++p;
+    else if (*p == '"') return p + 1;
+  }
+  return NULL;
+}
+
+// Past the value at p
+static char const *
+skip_value(char const *p, char const *end)
+{
+  if (p >= end) return NULL;
+  if (*p == '"') return skip_string(p, end);
+
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    while (p < end) {
+      if (*p == '"') {
+        p = skip_string(p, end);
+        if (! p) return NULL;
+        continue;
+      }
+      if (*p == '{' || *p == '[') {
+        depth++;
+      } else if (*p == '}' || *p == ']') {
+        if (--depth == 0) return p + 1;
+      }
+      ++p;
+    }
+    return NULL;
+  }
+
+  // Numbers, true, false and null
+  while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+         *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+    ++p;
+  }
+  return p;
+}
+
+// The value of the member or element named by step, in the object or
+// array at p, NULL if there isn't one
+static char const *
+json_step(char const *p, char const *end, char const *step, size_t len)
+{
+  if (p >= end) return NULL;
+
+  if (*p == '[') {
+    char *stop;
+    unsigned long want = strtoul(step, &stop, 10);
+    if (stop != step + len || ! len) return NULL;
+
+    p = skip_ws(p + 1, end);
+    for (unsigned long i = 0; p < end && *p != ']'; ++i) {
+      if (i == want) return p;
+      p = skip_value(p, end);
+      if (! p) return NULL;
+      p = skip_ws(p, end);
+      if (p >= end || *p != ',') return NULL;
+      p = skip_ws(p + 1, end);
+    }
+    return NULL;
+  }
+
+  if (*p != '{') return NULL;
+  p = skip_ws(p + 1, end);
+  while (p < end && *p == '"') {
+    char const *name = p + 1;
+    p = skip_string(p, end);
+    if (! p) return NULL;
+    bool match = (size_t) (p - 1 - name) == len && ! memcmp(name, step, len);
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != ':') return NULL;
+    p = skip_ws(p + 1, end);
+    if (match) return p;
+
+    p = skip_value(p, end);
+    if (! p) return NULL;
+    p = skip_ws(p, end);
+    if (p >= end || *p != ',') return NULL;
+    p = skip_ws(p + 1, end);
+  }
+  return NULL;
+}
+
+bool
+Extractor::json(char const *data, u_int32_t len,
+                char const **key, u_int32_t *klen) const
+{
+  char const *end = data + len;
+  char const *p = skip_ws(data, end);
+
+  for (char const *step = _path; p; ) {
+    char const *dot = strchr(step, '.');
+    size_t slen = dot ? (size_t) (dot - step) : strlen(step);
+    p = json_step(p, end, step, slen);
+    if (! dot) break;
+    step = dot + 1;
+  }
+  if (! p || p >= end || *p == '{' || *p == '[') return false;
+
+  char const *stop = skip_value(p, end);
+  if (! stop) return false;
+  if (*p == '"') {
+    ++p;
+    --stop;
+  }
+  *key = p;
+  *klen = stop - p;
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef EXTRACTOR_H
+#define EXTRACTOR_H
+
+#include <node.h>
+
+#include <db.h>
+
+// How a secondary index of a store opened with indexes finds its key in a
+// value.  Specs are parsed on the loop thread, keys are extracted on the
+// worker threads while BDB maintains the index, so an extractor is never
+// changed once made.
+//
+//   { offset: 4, length: 8 }       a byte range, to the end without length
+//   { field: 2, delimiter: ',' }   a delimiter-separated field, from 0
+//   { path: 'address.city' }       a JSON member, numbers index arrays
+//
+// JSON strings are indexed as the bytes between the quotes, escapes
+// included, other scalars as they are written.  Objects and arrays are
+// not indexed.
+class Extractor {
+ public:
+  // NULL for a spec that is none of the above
+  static Extractor *New(v8::Handle<v8::Object> spec);
+  ~Extractor();
+
+  // Point key at the index key within data.  Returns false if the value
+  // has none, and so stays out of the index.
+  bool extract(char const *data, u_int32_t len,
+               char const **key, u_int32_t *klen) const;
+
+ private:
+  enum Kind { BYTES, FIELD, JSON };
+
+  Extractor(Kind kind);
+
+  bool bytes(char const *data, u_int32_t len, char const **key, u_int32_t *klen) const;
+  bool field(char const *data, u_int32_t len, char const **key, u_int32_t *klen) const;
+  bool json(char const *data, u_int32_t len, char const **key, u_int32_t *klen) const;
+
+  Kind _kind;
+  u_int32_t _offset;
+  u_int32_t _length;  // 0 for the rest of the value
+  u_int32_t _field;
+  char _delimiter;
+  char *_path;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "opstats.h"
+
+#include <cstring>
+
+using namespace v8;
+
+void
+Histogram::reset()
+{
+  memset(_counts, 0, sizeof(_counts));
+  _count = _sum = _max = 0;
+  _min = ~(uint64_t) 0;
+}
+
+// Bucket i < SUB holds exactly i.  Above that, each power of two is split
+// into SUB buckets by the SUB_BITS bits below its highest set bit.
+int
+Histogram::index(uint64_t usec)
+{
+  if (usec < (uint64_t) SUB) return (int) usec;
+  int msb = 63;
+  while (! (usec >> msb)) --msb;
+  int shift = msb - SUB_BITS;
+  return (shift + 1) * SUB + (int) ((usec >> shift) & (SUB - 1));
+}
+
+uint64_t
+Histogram::highest(int index)
+{
+  if (index < SUB) return index;
+  int shift = index / SUB - 1;
+  uint64_t low = ((uint64_t) (SUB + index % SUB)) << shift;
+  return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void
+Histogram::record(uint64_t usec)
+{
+  _counts[index(usec)]++;
+  _count++;
+  _sum += usec;
+  if (usec < _min) _min = usec;
+  if (usec > _max) _max = usec;
+}
+
+uint64_t
+Histogram::percentile(double p) const
+{
+  if (! _count) return 0;
+  uint64_t rank = (uint64_t) (p * _count);
+  if (rank >= _count) rank = _count - 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += _counts[i];
+    if (seen > rank) {
+      uint64_t high = highest(i);
+      return high < _max ? high : _max;
+    }
+  }
+  return _max;
+}
+
+Handle<Object>
+Histogram::stats() const
+{
+  HandleScope scope;
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("count"), Number::New(_count));
+  stats->Set(String::NewSymbol("min"), Number::New(_count ? _min : 0));
+  stats->Set(String::NewSymbol("mean"), Number::New(_count ? (double) _sum / _count : 0));
+  stats->Set(String::NewSymbol("p50"), Number::New(percentile(0.5)));
+  stats->Set(String::NewSymbol("p90"), Number::New(percentile(0.9)));
+  stats->Set(String::NewSymbol("p99"), Number::New(percentile(0.99)));
+  stats->Set(String::NewSymbol("p999"), Number::New(percentile(0.999)));
+  stats->Set(String::NewSymbol("max"), Number::New(_max));
+
+  return scope.Close(stats);
+}
+
+char const *const OpStats::names[OpStats::NOPS] = {
+  "open", "close", "get", "put", "del", "append",
+  "getMany", "putMany", "scan", "sync", "flush", "sweep", "query",
+  "compact"
+};
+
+OpStats::OpStats()
+{
+  memset(_ops, 0, sizeof(_ops));
+}
+
+OpStats::~OpStats()
+{
+  for (int i = 0; i < NOPS; ++i) delete _ops[i];
+}
+
+void
+OpStats::record(char const *op, uint64_t queued, uint64_t started,
+                uint64_t finished, uint64_t called)
+{
+  if (! op) return;
+
+  int i = 0;
+  while (i < NOPS && strcmp(op, names[i])) ++i;
+  if (i == NOPS) return;
+
+  if (! _ops[i]) _ops[i] = new Op();
+  _ops[i]->queue.record((started - queued) / 1000);
+  _ops[i]->exec.record((finished - started) / 1000);
+  _ops[i]->total.record((called - queued) / 1000);
+}
+
+void
+OpStats::reset()
+{
+  for (int i = 0; i < NOPS; ++i) {
+    delete _ops[i];
+    _ops[i] = NULL;
+  }
+}
+
+Handle<Object>
+OpStats::stats() const
+{
+  HandleScope scope;
+
+  Local<Object> stats = Object::New();
+  for (int i = 0; i < NOPS; ++i) {
+    if (! _ops[i]) continue;
+    Local<Object> op = Object::New();
+    op->Set(String::NewSymbol("queue"), _ops[i]->queue.stats());
+    op->Set(String::NewSymbol("exec"), _ops[i]->exec.stats());
+    op->Set(String::NewSymbol("total"), _ops[i]->total.stats());
+    stats->Set(String::NewSymbol(names[i]), op);
+  }
+
+  return scope.Close(stats);
+}
@@ -0,0 +1,67 @@
+#ifndef OPSTATS_H
+#define OPSTATS_H
+
+#include <node.h>
+
+#include <stdint.h>
+
+// A latency histogram in microseconds, HDR style: exact below 16us, then
+// 16 linear buckets per power of two, so any value is within 1/16 of the
+// bucket it is counted in.  Fixed size, no allocation when recording.
+class Histogram {
+ public:
+  Histogram() { reset(); }
+
+  void record(uint64_t usec);
+  void reset();
+
+  uint64_t count() const { return _count; }
+
+  // The highest value counted in the same bucket as the p quantile
+  uint64_t percentile(double p) const;
+
+  v8::Handle<v8::Object> stats() const;
+
+ private:
+  static int const SUB_BITS = 4;
+  static int const SUB = 1 << SUB_BITS;
+  static int const BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+  static int index(uint64_t usec);
+  static uint64_t highest(int index);
+
+  uint32_t _counts[BUCKETS];
+  uint64_t _count;
+  uint64_t _sum;
+  uint64_t _min, _max;
+};
+
+// Per operation latencies of one store, recorded on the loop thread as
+// each callback is made: time waiting for a worker, time in Berkeley DB,
+// and the whole of it from the call to the callback.
+class OpStats {
+ public:
+  OpStats();
+  ~OpStats();
+
+  // Times are uv_hrtime() nanoseconds.  Unknown ops are not recorded.
+  void record(char const *op, uint64_t queued, uint64_t started,
+              uint64_t finished, uint64_t called);
+  void reset();
+
+  v8::Handle<v8::Object> stats() const;
+
+ private:
+  struct Op {
+    Histogram queue;
+    Histogram exec;
+    Histogram total;
+  };
+
+  static int const NOPS = 14;
+  static char const *const names[NOPS];
+
+  Op *_ops[NOPS];  // made on first use
+};
+
+#endif
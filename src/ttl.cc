@@ -0,0 +1,40 @@
+#include "ttl.h"
+
+#include <cstring>
+#include <ctime>
+
+u_int32_t
+Ttl::now()
+{
+  return (u_int32_t) time(NULL);
+}
+
+void
+Ttl::write(void *out, u_int32_t expires)
+{
+  u_int8_t *p = (u_int8_t *) out;
+  p[0] = expires >> 24;
+  p[1] = expires >> 16;
+  p[2] = expires >> 8;
+  p[3] = expires;
+}
+
+u_int32_t
+Ttl::read(void const *in)
+{
+  u_int8_t const *p = (u_int8_t const *) in;
+  return ((u_int32_t) p[0] << 24) | ((u_int32_t) p[1] << 16) |
+         ((u_int32_t) p[2] << 8) | p[3];
+}
+
+int
+Ttl::extract(DB *secondary, DBT const *key, DBT const *data, DBT *result)
+{
+  if (data->size < HEADER || ! read(data->data)) return DB_DONOTINDEX;
+
+  // The index key is the header itself, in place
+  memset(result, 0, sizeof(*result));
+  result->data = data->data;
+  result->size = HEADER;
+  return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef TTL_H
+#define TTL_H
+
+#include <db.h>
+
+// Expiry for stores opened with ttl.  Every value in such a store starts
+// with the second it expires at, as a big-endian u_int32_t so that the
+// expiry index sorts by time, or zero if it never does.  The header goes
+// outside any compression, so the index can read it as it is.
+class Ttl {
+ public:
+  static u_int32_t const HEADER = sizeof(u_int32_t);
+
+  // Seconds since the epoch
+  static u_int32_t now();
+
+  // When a value put now with a ttl in seconds expires, 0 for never
+  static u_int32_t expires(u_int32_t ttl) { return ttl ? now() + ttl : 0; }
+
+  static bool expired(u_int32_t expires, u_int32_t now) {
+    return expires && expires <= now;
+  }
+
+  static void write(void *out, u_int32_t expires);
+  static u_int32_t read(void const *in);
+
+  // DB->associate callback for the expiry index, records that never
+  // expire are left out of it
+  static int extract(DB *secondary, DBT const *key, DBT const *data, DBT *result);
+};
+
+#endif
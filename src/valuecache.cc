@@ -0,0 +1,190 @@
+#include "valuecache.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace v8;
+
+u_int32_t
+ValueCache::hash(void const *key, u_int32_t len)
+{
+  // FNV-1a
+  u_int8_t const *p = (u_int8_t const *) key;
+  u_int32_t h = 2166136261U;
+  while (len--) {
+    h = (h ^ *p++) * 16777619U;
+  }
+  return h;
+}
+
+ValueCache::ValueCache(size_t max_bytes)
+  : _max_bytes(max_bytes), _bytes(0), _entries(0), _nbuckets(256),
+    _head(0), _tail(0), _hits(0), _misses(0), _evictions(0) {
+  _buckets = (Entry **) calloc(_nbuckets, sizeof(Entry *));
+  memset(_versions, 0, sizeof(_versions));
+}
+
+ValueCache::~ValueCache() {
+  clear();
+  free(_buckets);
+}
+
+ValueCache::Entry **
+ValueCache::lookup(void const *key, u_int32_t klen, u_int32_t hash)
+{
+  Entry **link = &_buckets[hash & (_nbuckets - 1)];
+  for (; *link; link = &(*link)->hnext) {
+    Entry *entry = *link;
+    if (entry->hash == hash && entry->klen == klen &&
+        ! memcmp(entry->key(), key, klen)) {
+      break;
+    }
+  }
+  return link;
+}
+
+void
+ValueCache::unlink(Entry *entry)
+{
+  if (entry->prev) entry->prev->next = entry->next;
+  else _head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else _tail = entry->prev;
+}
+
+void
+ValueCache::remove(Entry *entry)
+{
+  Entry **link = lookup(entry->key(), entry->klen, entry->hash);
+  *link = entry->hnext;
+  unlink(entry);
+  _bytes -= sizeof(Entry) + entry->klen + entry->dlen;
+  _entries--;
+  free(entry);
+}
+
+void
+ValueCache::grow()
+{
+  u_int32_t nbuckets = _nbuckets * 2;
+  Entry **buckets = (Entry **) calloc(nbuckets, sizeof(Entry *));
+  for (u_int32_t i = 0; i < _nbuckets; ++i) {
+    Entry *entry = _buckets[i];
+    while (entry) {
+      Entry *next = entry->hnext;
+      Entry **head = &buckets[entry->hash & (nbuckets - 1)];
+      entry->hnext = *head;
+      *head = entry;
+      entry = next;
+    }
+  }
+  free(_buckets);
+  _buckets = buckets;
+  _nbuckets = nbuckets;
+}
+
+bool
+ValueCache::get(void const *key, u_int32_t klen, char **data, u_int32_t *dlen)
+{
+  Entry *entry = *lookup(key, klen, hash(key, klen));
+  if (! entry) {
+    _misses++;
+    return false;
+  }
+  _hits++;
+
+  // Move to the front
+  if (entry != _head) {
+    unlink(entry);
+    entry->prev = NULL;
+    entry->next = _head;
+    _head->prev = entry;
+    _head = entry;
+  }
+
+  *data = entry->data();
+  *dlen = entry->dlen;
+  return true;
+}
+
+u_int32_t
+ValueCache::version(void const *key, u_int32_t klen)
+{
+  return _versions[hash(key, klen) % STRIPES];
+}
+
+void
+ValueCache::fill(void const *key, u_int32_t klen, void const *data, u_int32_t dlen,
+                 u_int32_t version)
+{
+  u_int32_t h = hash(key, klen);
+  if (_versions[h % STRIPES] != version) return;
+
+  size_t size = sizeof(Entry) + klen + dlen;
+  if (size > _max_bytes / 8) return; // Don't let one value flush the rest
+
+  Entry *old = *lookup(key, klen, h);
+  if (old) remove(old);
+
+  while (_tail && _bytes + size > _max_bytes) {
+    remove(_tail);
+    _evictions++;
+  }
+
+  Entry *entry = (Entry *) malloc(size);
+  entry->hash = h;
+  entry->klen = klen;
+  entry->dlen = dlen;
+  memcpy(entry->key(), key, klen);
+  memcpy(entry->data(), data, dlen);
+
+  Entry **head = &_buckets[h & (_nbuckets - 1)];
+  entry->hnext = *head;
+  *head = entry;
+
+  entry->prev = NULL;
+  entry->next = _head;
+  if (_head) _head->prev = entry;
+  else _tail = entry;
+  _head = entry;
+
+  _bytes += size;
+  if (++_entries > _nbuckets) grow();
+}
+
+void
+ValueCache::invalidate(void const *key, u_int32_t klen)
+{
+  u_int32_t h = hash(key, klen);
+  _versions[h % STRIPES]++;
+
+  Entry *entry = *lookup(key, klen, h);
+  if (entry) remove(entry);
+}
+
+void
+ValueCache::clear()
+{
+  while (_head) {
+    remove(_head);
+  }
+  for (int i = 0; i < STRIPES; ++i) {
+    _versions[i]++;
+  }
+}
+
+Handle<Object>
+ValueCache::stats()
+{
+  HandleScope scope;
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("hits"), Number::New(_hits));
+  stats->Set(String::NewSymbol("misses"), Number::New(_misses));
+  stats->Set(String::NewSymbol("evictions"), Number::New(_evictions));
+  stats->Set(String::NewSymbol("entries"), Integer::NewFromUnsigned(_entries));
+  stats->Set(String::NewSymbol("bytes"), Number::New(_bytes));
+  stats->Set(String::NewSymbol("maxBytes"), Number::New(_max_bytes));
+
+  return scope.Close(stats);
+}
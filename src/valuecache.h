@@ -0,0 +1,64 @@
+#ifndef VALUECACHE_H
+#define VALUECACHE_H
+
+#include <node.h>
+
+#include <db.h>
+
+// A byte-bounded LRU of raw values by raw key, in front of a store.  It
+// is only touched on the loop thread, so there is no locking.
+//
+// Writes bump a version for the key's stripe both when they are queued and
+// when they complete, and a lookup only fills the cache if the version it
+// started with is still current, so a read racing a write can't leave the
+// old value behind.
+class ValueCache {
+ public:
+  explicit ValueCache(size_t max_bytes);
+  ~ValueCache();
+
+  // The cached value, valid until the next call that changes the cache
+  bool get(void const *key, u_int32_t klen, char **data, u_int32_t *dlen);
+
+  u_int32_t version(void const *key, u_int32_t klen);
+  void fill(void const *key, u_int32_t klen, void const *data, u_int32_t dlen,
+            u_int32_t version);
+  void invalidate(void const *key, u_int32_t klen);
+  void clear();
+
+  v8::Handle<v8::Object> stats();
+
+  static u_int32_t hash(void const *key, u_int32_t len);
+
+ private:
+  struct Entry {
+    Entry *hnext;           // hash chain
+    Entry *prev, *next;     // LRU list, most recent at the head
+    u_int32_t hash;
+    u_int32_t klen, dlen;
+
+    char *key() { return (char *)(this + 1); }
+    char *data() { return key() + klen; }
+  };
+
+  static int const STRIPES = 256;
+
+  Entry **lookup(void const *key, u_int32_t klen, u_int32_t hash);
+  void unlink(Entry *entry);
+  void remove(Entry *entry);
+  void grow();
+
+  size_t _max_bytes;
+  size_t _bytes;
+  u_int32_t _entries;
+
+  Entry **_buckets;
+  u_int32_t _nbuckets;      // power of two
+  Entry *_head, *_tail;
+
+  u_int32_t _versions[STRIPES];
+
+  double _hits, _misses, _evictions;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include "workpool.h"
+
+using namespace v8;
+
+struct Job {
+  uv_work_t *req;
+  uv_work_cb work;
+  uv_after_work_cb after;
+  Job *next;
+  WorkPool::Timing timing;
+};
+
+struct JobList {
+  Job *head;
+  Job *tail;
+
+  void push(Job *job) {
+    job->next = NULL;
+    if (tail) tail->next = job;
+    else head = job;
+    tail = job;
+  }
+
+  Job *take() {
+    Job *job = head;
+    head = tail = NULL;
+    return job;
+  }
+};
+
+// Thread counts, fixed once the pool has started
+static int nthreads[2] = { 4, 2 };
+
+static bool started = false;
+static int pending = 0;     // jobs queued and not yet completed, loop thread only
+
+static uv_mutex_t mutex;    // guards the queues and the done list
+static JobList queues[2];
+static uv_cond_t ready[2];
+static JobList done;
+static uv_async_t async;
+
+WorkPool::Timing WorkPool::_timing;
+
+void
+WorkPool::Init(Handle<Object> target) {
+  target->Set(String::NewSymbol("configureWorkers"),
+      FunctionTemplate::New(Configure)->GetFunction());
+}
+
+void
+WorkPool::start()
+{
+  started = true;
+  uv_mutex_init(&mutex);
+  uv_async_init(uv_default_loop(), &async, Complete);
+  uv_unref((uv_handle_t *)&async);
+
+  for (int q = READ; q <= WRITE; ++q) {
+    queues[q].head = queues[q].tail = NULL;
+    uv_cond_init(&ready[q]);
+    for (int i = 0; i < nthreads[q]; ++i) {
+      uv_thread_t tid;
+      uv_thread_create(&tid, Worker, &ready[q]);
+    }
+  }
+  done.head = done.tail = NULL;
+}
+
+int
+WorkPool::queue(Queue q, uv_work_t *req, uv_work_cb work, uv_after_work_cb after)
+{
+  if (! started) start();
+
+  Job *job = (Job *) Recycler<sizeof(Job)>::get();
+  job->req = req;
+  job->work = work;
+  job->after = after;
+  job->timing.queued = uv_hrtime();
+
+  // Outstanding work keeps the loop alive, just as uv_queue_work does
+  if (pending++ == 0) {
+    uv_ref((uv_handle_t *)&async);
+  }
+
+  uv_mutex_lock(&mutex);
+  queues[q].push(job);
+  uv_cond_signal(&ready[q]);
+  uv_mutex_unlock(&mutex);
+  return 0;
+}
+
+void
+WorkPool::complete(uv_work_t *req, uv_after_work_cb after)
+{
+  if (! started) start();
+
+  Job *job = (Job *) Recycler<sizeof(Job)>::get();
+  job->req = req;
+  job->work = NULL;
+  job->after = after;
+  job->timing.queued = job->timing.started = job->timing.finished = uv_hrtime();
+
+  if (pending++ == 0) {
+    uv_ref((uv_handle_t *)&async);
+  }
+
+  uv_mutex_lock(&mutex);
+  done.push(job);
+  uv_mutex_unlock(&mutex);
+  uv_async_send(&async);
+}
+
+// Workers run for the life of the process
+void
+WorkPool::Worker(void *arg)
+{
+  uv_cond_t *cond = (uv_cond_t *) arg;
+  JobList &jobs = queues[cond - ready];
+
+  uv_mutex_lock(&mutex);
+  for (;;) {
+    while (! jobs.head) {
+      uv_cond_wait(cond, &mutex);
+    }
+    Job *job = jobs.head;
+    jobs.head = job->next;
+    if (! jobs.head) jobs.tail = NULL;
+    uv_mutex_unlock(&mutex);
+
+    job->timing.started = uv_hrtime();
+    job->work(job->req);
+    job->timing.finished = uv_hrtime();
+
+    uv_mutex_lock(&mutex);
+    done.push(job);
+    uv_async_send(&async);
+  }
+}
+
+// Sends are coalesced, so one wakeup completes every job finished since
+// the last, all under one handle scope.
+void
+WorkPool::Complete(uv_async_t *handle, int status)
+{
+  HandleScope scope;
+
+  uv_mutex_lock(&mutex);
+  Job *job = done.take();
+  uv_mutex_unlock(&mutex);
+
+  int completed = 0;
+  while (job) {
+    Job *next = job->next;
+    _timing = job->timing;
+    job->after(job->req, 0);
+    Recycler<sizeof(Job)>::put(job);
+    job = next;
+    ++completed;
+  }
+
+  pending -= completed;
+  if (completed && pending == 0) {
+    uv_unref((uv_handle_t *)&async);
+  }
+}
+
+static bool
+count_opt(Handle<Object> opts, char const *name, int *count)
+{
+  Local<Value> val = opts->Get(String::NewSymbol(name));
+  if (val->IsUndefined()) return true;
+  if (! val->IsNumber() || val->Int32Value() < 1) return false;
+  *count = val->Int32Value();
+  return true;
+}
+
+Handle<Value> WorkPool::Configure(const Arguments& args) {
+  HandleScope scope;
+
+  if (! args[0]->IsObject()) {
+    ThrowException(Exception::TypeError(String::New("First argument must be an options Object")));
+    return scope.Close(Undefined());
+  }
+  if (started) {
+    ThrowException(Exception::Error(String::New("Workers are already running")));
+    return scope.Close(Undefined());
+  }
+
+  Local<Object> opts = args[0]->ToObject();
+  int counts[2] = { nthreads[READ], nthreads[WRITE] };
+  if (! count_opt(opts, "readers", &counts[READ]) ||
+      ! count_opt(opts, "writers", &counts[WRITE])) {
+    ThrowException(Exception::RangeError(String::New("Thread counts must be at least 1")));
+    return scope.Close(Undefined());
+  }
+  nthreads[READ] = counts[READ];
+  nthreads[WRITE] = counts[WRITE];
+
+  return scope.Close(Undefined());
+}
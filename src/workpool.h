@@ -0,0 +1,95 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <node.h>
+
+#include <cstdlib>
+
+// A freelist for small per-operation allocations.  Only for memory taken
+// and given back on the loop thread, so there is no locking.
+template <size_t Size>
+class Recycler {
+ public:
+  static void *get() {
+    if (! _free) {
+      return malloc(Size > sizeof(Node) ? Size : sizeof(Node));
+    }
+    Node *node = _free;
+    _free = node->next;
+    --_count;
+    return node;
+  }
+
+  static void put(void *p) {
+    if (_count >= MAX_FREE) {
+      free(p);
+      return;
+    }
+    Node *node = (Node *) p;
+    node->next = _free;
+    _free = node;
+    ++_count;
+  }
+
+ private:
+  struct Node {
+    Node *next;
+  };
+
+  static int const MAX_FREE = 1024;
+  static Node *_free;
+  static int _count;
+};
+
+template <size_t Size>
+typename Recycler<Size>::Node *Recycler<Size>::_free = 0;
+template <size_t Size>
+int Recycler<Size>::_count = 0;
+
+// The threads all database work runs on.  Keeping them apart from the
+// libuv pool means DB calls don't queue behind fs, dns and zlib jobs, and
+// reads have threads of their own so a put stuck in fsync can't hold them
+// up.  Completions come back to the loop through a uv_async_t.
+class WorkPool {
+ public:
+  enum Queue { READ, WRITE };
+
+  static void Init(v8::Handle<v8::Object> target);
+
+  // Same contract as uv_queue_work on the default loop, must be called
+  // from the loop thread
+  static int queue(Queue q, uv_work_t *req, uv_work_cb work, uv_after_work_cb after);
+
+  // Run after on the loop as if work had finished, for operations that
+  // are answered without going near the database
+  static void complete(uv_work_t *req, uv_after_work_cb after);
+
+  // uv_hrtime() stamps of the job whose after callback is running: when
+  // it was queued, and when a worker started and finished it.  Jobs from
+  // complete() have all three the same.
+  struct Timing {
+    uint64_t queued;
+    uint64_t started;
+    uint64_t finished;
+  };
+  static Timing const &timing() { return _timing; }
+
+  // Recycled work requests, in place of new and delete uv_work_t
+  static uv_work_t *new_req() {
+    return (uv_work_t *) Recycler<sizeof(uv_work_t)>::get();
+  }
+  static void free_req(uv_work_t *req) {
+    Recycler<sizeof(uv_work_t)>::put(req);
+  }
+
+ private:
+  static void start();
+  static void Worker(void *arg);
+  static void Complete(uv_async_t *async, int status);
+
+  static Timing _timing;
+
+  static v8::Handle<v8::Value> Configure(const v8::Arguments& args);
+};
+
+#endif
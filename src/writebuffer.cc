@@ -0,0 +1,239 @@
+#include "writebuffer.h"
+#include "valuecache.h"
+
+#include <cstdlib>
+#include <cstring>
+
+void
+WriteBuffer::Table::init()
+{
+  nbuckets = 256;
+  buckets = (Entry **) calloc(nbuckets, sizeof(Entry *));
+  count = 0;
+  bytes = 0;
+}
+
+void
+WriteBuffer::Table::clear()
+{
+  for (u_int32_t i = 0; i < nbuckets; ++i) {
+    Entry *entry = buckets[i];
+    while (entry) {
+      Entry *next = entry->hnext;
+      free(entry);
+      entry = next;
+    }
+    buckets[i] = NULL;
+  }
+  count = 0;
+  bytes = 0;
+}
+
+WriteBuffer::Entry **
+WriteBuffer::Table::lookup(void const *key, u_int32_t klen, u_int32_t hash)
+{
+  Entry **link = &buckets[hash & (nbuckets - 1)];
+  for (; *link; link = &(*link)->hnext) {
+    Entry *entry = *link;
+    if (entry->hash == hash && entry->klen == klen &&
+        ! memcmp(entry->key(), key, klen)) {
+      break;
+    }
+  }
+  return link;
+}
+
+// Add an entry whose key isn't in the table yet
+void
+WriteBuffer::Table::insert(Entry *entry)
+{
+  if (count >= nbuckets) {
+    u_int32_t n = nbuckets * 2;
+    Entry **grown = (Entry **) calloc(n, sizeof(Entry *));
+    for (u_int32_t i = 0; i < nbuckets; ++i) {
+      Entry *e = buckets[i];
+      while (e) {
+        Entry *next = e->hnext;
+        Entry **head = &grown[e->hash & (n - 1)];
+        e->hnext = *head;
+        *head = e;
+        e = next;
+      }
+    }
+    free(buckets);
+    buckets = grown;
+    nbuckets = n;
+  }
+
+  Entry **head = &buckets[entry->hash & (nbuckets - 1)];
+  entry->hnext = *head;
+  *head = entry;
+  count++;
+  bytes += sizeof(Entry) + entry->klen + entry->dlen;
+}
+
+WriteBuffer::WriteBuffer() : _flushing(false) {
+  _active.init();
+  _flush.init();
+}
+
+WriteBuffer::~WriteBuffer() {
+  _active.clear();
+  _flush.clear();
+  free(_active.buckets);
+  free(_flush.buckets);
+}
+
+void
+WriteBuffer::write(void const *key, u_int32_t klen, void const *head, u_int32_t hlen,
+                   void const *data, u_int32_t dlen, bool deleted)
+{
+  u_int32_t hash = ValueCache::hash(key, klen);
+  Entry **link = _active.lookup(key, klen, hash);
+  if (*link) {
+    Entry *old = *link;
+    *link = old->hnext;
+    _active.count--;
+    _active.bytes -= sizeof(Entry) + old->klen + old->dlen;
+    free(old);
+  }
+
+  Entry *entry = (Entry *) malloc(sizeof(Entry) + klen + hlen + dlen);
+  entry->hash = hash;
+  entry->klen = klen;
+  entry->dlen = hlen + dlen;
+  entry->deleted = deleted;
+  memcpy(entry->key(), key, klen);
+  if (hlen) memcpy(entry->data(), head, hlen);
+  if (dlen) memcpy(entry->data() + hlen, data, dlen);
+  _active.insert(entry);
+}
+
+void
+WriteBuffer::put(void const *key, u_int32_t klen, void const *data, u_int32_t dlen,
+                 void const *head, u_int32_t hlen)
+{
+  write(key, klen, head, hlen, data, dlen, false);
+}
+
+void
+WriteBuffer::del(void const *key, u_int32_t klen)
+{
+  write(key, klen, NULL, 0, NULL, 0, true);
+}
+
+WriteBuffer::Lookup
+WriteBuffer::get(void const *key, u_int32_t klen, char **data, u_int32_t *dlen)
+{
+  u_int32_t hash = ValueCache::hash(key, klen);
+  Entry *entry = *_active.lookup(key, klen, hash);
+  if (! entry && _flushing) {
+    entry = *_flush.lookup(key, klen, hash);
+  }
+  if (! entry) return MISSING;
+  if (entry->deleted) return DELETED;
+
+  *data = entry->data();
+  *dlen = entry->dlen;
+  return FOUND;
+}
+
+void
+WriteBuffer::start_flush()
+{
+  Table t = _flush;
+  _flush = _active;
+  _active = t;
+  _flushing = true;
+}
+
+// Same ordering as the default B-tree comparison, for qsort on Entry*
+int
+WriteBuffer::compare(void const *a, void const *b)
+{
+  Entry *ea = *(Entry * const *) a;
+  Entry *eb = *(Entry * const *) b;
+  int c = memcmp(ea->key(), eb->key(), ea->klen < eb->klen ? ea->klen : eb->klen);
+  if (c) return c;
+  return ea->klen < eb->klen ? -1 : (ea->klen > eb->klen ? 1 : 0);
+}
+
+void
+WriteBuffer::pack(bool recno, DBT *puts, char **bulk, DBT **dels, u_int32_t *ndels)
+{
+  Entry **sorted = (Entry **) malloc((_flush.count ? _flush.count : 1) * sizeof(Entry *));
+  u_int32_t n = 0, nputs = 0;
+  size_t size = 0;
+  for (u_int32_t i = 0; i < _flush.nbuckets; ++i) {
+    for (Entry *entry = _flush.buckets[i]; entry; entry = entry->hnext) {
+      sorted[n++] = entry;
+      if (! entry->deleted) {
+        nputs++;
+        size += entry->klen + entry->dlen;
+      }
+    }
+  }
+  qsort(sorted, n, sizeof(Entry *), compare);
+
+  // Data from the front, the offset table (at most four u_int32_t per
+  // pair, plus terminator) back from the u_int32_t aligned end
+  size = (size + sizeof(u_int32_t) - 1) & ~(sizeof(u_int32_t) - 1);
+  size += (4 * nputs + 1) * sizeof(u_int32_t);
+  *bulk = (char *) malloc(size);
+  memset(puts, 0, sizeof(*puts));
+  puts->data = *bulk;
+  puts->ulen = size;
+  puts->flags = DB_DBT_USERMEM;
+
+  *dels = (DBT *) calloc(n - nputs + 1, sizeof(DBT));
+  *ndels = 0;
+
+  void *p, *kp, *dp;
+  DB_MULTIPLE_WRITE_INIT(p, puts);
+  for (u_int32_t i = 0; i < n; ++i) {
+    Entry *entry = sorted[i];
+    if (entry->deleted) {
+      DBT *key = &(*dels)[(*ndels)++];
+      key->data = entry->key();
+      key->size = entry->klen;
+      key->flags = DB_DBT_USERMEM;
+      continue;
+    }
+    if (recno) {
+      db_recno_t rn;
+      memcpy(&rn, entry->key(), sizeof(rn));
+      DB_MULTIPLE_RECNO_RESERVE_NEXT(p, puts, rn, dp, entry->dlen);
+    } else {
+      DB_MULTIPLE_KEY_RESERVE_NEXT(p, puts, kp, entry->klen, dp, entry->dlen);
+      memcpy(kp, entry->key(), entry->klen);
+    }
+    memcpy(dp, entry->data(), entry->dlen);
+  }
+  puts->size = nputs ? size : 0;
+  free(sorted);
+}
+
+void
+WriteBuffer::end_flush(bool failed)
+{
+  if (failed) {
+    for (u_int32_t i = 0; i < _flush.nbuckets; ++i) {
+      Entry *entry = _flush.buckets[i];
+      while (entry) {
+        Entry *next = entry->hnext;
+        if (*_active.lookup(entry->key(), entry->klen, entry->hash)) {
+          free(entry);
+        } else {
+          _active.insert(entry);
+        }
+        entry = next;
+      }
+      _flush.buckets[i] = NULL;
+    }
+    _flush.count = 0;
+    _flush.bytes = 0;
+  } else {
+    _flush.clear();
+  }
+  _flushing = false;
+}
@@ -0,0 +1,76 @@
+#ifndef WRITEBUFFER_H
+#define WRITEBUFFER_H
+
+#include <node.h>
+
+#include <db.h>
+
+// Puts and dels held back by a write-behind store.  Repeated writes to a
+// key replace each other, and a flush writes out what is left in key
+// order.  While a flush is running its writes stay readable, and new ones
+// collect in a fresh table.
+//
+// Everything is on the loop thread except pack(), which a worker runs
+// against the flushing table while the loop only reads it.
+class WriteBuffer {
+ public:
+  WriteBuffer();
+  ~WriteBuffer();
+
+  // The value is head followed by data
+  void put(void const *key, u_int32_t klen, void const *data, u_int32_t dlen,
+           void const *head = NULL, u_int32_t hlen = 0);
+  void del(void const *key, u_int32_t klen);
+
+  enum Lookup { MISSING, FOUND, DELETED };
+  Lookup get(void const *key, u_int32_t klen, char **data, u_int32_t *dlen);
+
+  size_t bytes() const { return _active.bytes; }
+  bool empty() const { return _active.count == 0; }
+  bool flushing() const { return _flushing; }
+
+  // Hand the buffered writes over to a flush
+  void start_flush();
+
+  // Pack the flushing writes, sorted by key: puts as a malloc'ed
+  // DB_MULTIPLE_KEY buffer (record numbers for recno), dels as a malloc'ed
+  // array of DBTs pointing at the keys.
+  void pack(bool recno, DBT *puts, char **bulk, DBT **dels, u_int32_t *ndels);
+
+  // The flush is over.  A failed one puts back whatever hasn't been
+  // written over since, to go again next time.
+  void end_flush(bool failed);
+
+ private:
+  struct Entry {
+    Entry *hnext;
+    u_int32_t hash;
+    u_int32_t klen, dlen;
+    bool deleted;
+
+    char *key() { return (char *)(this + 1); }
+    char *data() { return key() + klen; }
+  };
+
+  struct Table {
+    Entry **buckets;
+    u_int32_t nbuckets;   // power of two
+    u_int32_t count;
+    size_t bytes;
+
+    void init();
+    void clear();
+    Entry **lookup(void const *key, u_int32_t klen, u_int32_t hash);
+    void insert(Entry *entry);
+  };
+
+  void write(void const *key, u_int32_t klen, void const *head, u_int32_t hlen,
+             void const *data, u_int32_t dlen, bool deleted);
+  static int compare(void const *a, void const *b);
+
+  Table _active;
+  Table _flush;
+  bool _flushing;
+};
+
+#endif
@@ -1,5 +1,7 @@
 var DbStore = require("..");
 
+DbStore.configureWorkers({ readers: 4, writers: 2 });
+
 var dbstore = new DbStore();
 
 var dbenv = new DbStore.DbEnv();
@@ -60,7 +62,791 @@ dbstore.open("foo.db", function (err, val) {
     });
   }
 
-  async.series([test_put_get, test_json], function (err) {
+  function test_get_sync(done) {
+    console.log("-- test_get_sync");
+    dbstore.put("sync1", { n: 1 }, { json: true }, function (err) {
+      assert.ifError(err);
+      var val = dbstore.getSync("sync1", { json: true });
+      assert(val.n == 1);
+      assert(dbstore.getSync("sync-missing") === undefined);
+      dbstore.del("sync1", done);
+    });
+  }
+
+  function test_binary_keys(done) {
+    console.log("-- test_binary_keys");
+    function intKey(n) {
+      var key = new Buffer(8);
+      key.fill(0);
+      key.writeUInt32BE(n, 4);
+      return key;
+    }
+    var pairs = [];
+    for (var i = 0; i < 100; ++i) {
+      pairs.push([intKey(i), "n" + i]);
+    }
+    dbstore.putMany(pairs, function (err) {
+      assert.ifError(err);
+      dbstore.get(intKey(42), 'utf8', function (err, val) {
+	assert.ifError(err);
+	assert(val == "n42");
+	var it = dbstore.iterator({ gte: intKey(10), lt: intKey(20), keyEncoding: 'buffer', encoding: 'utf8' });
+	var n = 10;
+	(function loop() {
+	  it.next(function (err, key, val) {
+	    assert.ifError(err);
+	    if (key === undefined) {
+	      assert(n == 20);
+	      return async.forEach(pairs, function (pair, next) {
+		dbstore.del(pair[0], next);
+	      }, done);
+	    }
+	    assert(key.readUInt32BE(4) == n);
+	    assert(val == "n" + n);
+	    ++n;
+	    loop();
+	  });
+	})();
+      });
+    });
+  }
+
+  function test_put_many(done) {
+    console.log("-- test_put_many");
+    var pairs = [];
+    for (var i = 0; i < 1000; ++i) {
+      pairs.push(["many" + i, { n: i }]);
+    }
+    dbstore.putMany(pairs, { json: true }, function (err) {
+      assert.ifError(err);
+      async.forEach(pairs, function (pair, next) {
+	dbstore.get(pair[0], { json: true }, function (err, data) {
+	  assert.ifError(err);
+	  assert(data.n == pair[1].n);
+	  dbstore.del(pair[0], next);
+	});
+      }, done);
+    });
+  }
+
+  function test_get_many(done) {
+    console.log("-- test_get_many");
+    var pairs = [["gm1", "one"], ["gm2", "two"], ["gm3", "three"]];
+    dbstore.putMany(pairs, function (err) {
+      assert.ifError(err);
+      dbstore.getMany(["gm1", "missing", "gm3", "gm2"], 'utf8', function (err, vals) {
+	assert.ifError(err);
+	assert(vals.length == 4);
+	assert(vals[0] == "one");
+	assert(vals[1] === undefined);
+	assert(vals[2] == "three");
+	assert(vals[3] == "two");
+	async.forEach(pairs, function (pair, next) {
+	  dbstore.del(pair[0], next);
+	}, done);
+      });
+    });
+  }
+
+  function test_scan(done) {
+    console.log("-- test_scan");
+    var pairs = [];
+    for (var i = 0; i < 500; ++i) {
+      pairs.push(["scan" + (1000 + i), "v" + i]);
+    }
+    function collect(opts, cb) {
+      var it = dbstore.iterator(opts), got = [];
+      (function loop() {
+	it.next(function (err, key, val) {
+	  assert.ifError(err);
+	  if (key === undefined) { return cb(got); }
+	  got.push([key, val]);
+	  loop();
+	});
+      })();
+    }
+    dbstore.putMany(pairs, function (err) {
+      assert.ifError(err);
+      collect({ prefix: "scan", encoding: 'utf8', bufferSize: 1024 }, function (got) {
+	assert(got.length == pairs.length);
+	assert(got[0][0] == "scan1000" && got[0][1] == "v0");
+	assert(got[499][0] == "scan1499");
+	collect({ gt: "scan1100", lte: "scan1200", reverse: true, limit: 10 }, function (got) {
+	  assert(got.length == 10);
+	  assert(got[0][0] == "scan1200");
+	  assert(got[9][0] == "scan1191");
+	  async.forEach(pairs, function (pair, next) {
+	    dbstore.del(pair[0], next);
+	  }, done);
+	});
+      });
+    });
+  }
+
+  function test_env(done) {
+    console.log("-- test_env");
+    var fs = require('fs');
+    if (! fs.existsSync("test_env")) { fs.mkdirSync("test_env"); }
+    dbenv.open("test_env", { cacheSize: 8 * 1024 * 1024, cacheMax: 32 * 1024 * 1024 }, function (err) {
+      assert.ifError(err);
+      var store = new DbStore();
+      store.open("env.db", { env: dbenv }, function (err) {
+	assert.ifError(err);
+	store.put("envkey", "envval", function (err) {
+	  assert.ifError(err);
+	  dbenv.setCacheSize(16 * 1024 * 1024, function (err) {
+	    assert.ifError(err);
+	    store.get("envkey", 'utf8', function (err, val) {
+	      assert.ifError(err);
+	      assert(val == "envval");
+	      dbenv.stat(function (err, stats) {
+		assert.ifError(err);
+		assert(stats.mpool.hits + stats.mpool.misses > 0);
+		assert(stats.lock === undefined);
+		assert.throws(function () { dbenv.close(function () {}); }, /stores still open/);
+		store.close(function (err) {
+		  assert.ifError(err);
+		  dbenv.close(done);
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  function test_txn(done) {
+    console.log("-- test_txn");
+    var fs = require('fs');
+    if (! fs.existsSync("test_txn")) { fs.mkdirSync("test_txn"); }
+    var env = new DbStore.DbEnv();
+    env.open("test_txn", { transactional: true, groupCommit: 5 }, function (err) {
+      assert.ifError(err);
+      var store = new DbStore();
+      store.open("txn.db", { env: env }, function (err) {
+	assert.ifError(err);
+	var txn = env.begin();
+	store.put("committed", "yes", { txn: txn }, function (err) {
+	  assert.ifError(err);
+	  txn.commit(function (err) {
+	    assert.ifError(err);
+	    var txn2 = env.begin();
+	    store.put("aborted", "no", { txn: txn2 }, function (err) {
+	      assert.ifError(err);
+	      txn2.abort(function (err) {
+		assert.ifError(err);
+		store.get("committed", 'utf8', function (err, val) {
+		  assert.ifError(err);
+		  assert(val == "yes");
+		  store.get("aborted", function (err) {
+		    assert(err);
+		    test_txn_order(env, store, done);
+		  });
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  // Commit called before the put in the transaction has finished waits
+  // for it, and close aborts what was never committed
+  function test_txn_order(env, store, done) {
+    var txn = env.begin(), order = [];
+    store.put("early", "yes", { txn: txn }, function (err) {
+      assert.ifError(err);
+      order.push("put");
+    });
+    txn.commit(function (err) {
+      assert.ifError(err);
+      order.push("commit");
+      assert(order.join() == "put,commit");
+      store.get("early", 'utf8', function (err, val) {
+	assert.ifError(err);
+	assert(val == "yes");
+	var open = env.begin();
+	store.get("early", { txn: open }, function (err) {
+	  assert.ifError(err);
+	  store.close(function (err) {
+	    assert.ifError(err);
+	    env.close(function (err) {
+	      assert.ifError(err);
+	      assert.throws(function () { open.commit(function () {}); });
+	      done();
+	    });
+	  });
+	});
+	assert.throws(function () { env.close(function () {}); }, /transactions still running/);
+      });
+    });
+  }
+
+  // env.close flushes commits waiting on a group commit window, rather
+  // than closing under them or waiting for the window to end
+  function test_group_close(done) {
+    console.log("-- test_group_close");
+    var env = new DbStore.DbEnv();
+    env.open("test_txn", { transactional: true, groupCommit: 10000 }, function (err) {
+      assert.ifError(err);
+      var store = new DbStore();
+      var committed = false;
+      store.open("txn.db", { env: env }, function (err) {
+	assert.ifError(err);
+	var txn = env.begin();
+	store.put("grouped", "yes", { txn: txn }, function (err) {
+	  assert.ifError(err);
+	  txn.commit(function (err) {
+	    assert.ifError(err);
+	    committed = true;
+	  });
+	  store.close(function (err) {
+	    assert.ifError(err);
+	    close_env();
+	  });
+	});
+      });
+
+      // The commit itself has to be done before the env can close
+      function close_env() {
+	try {
+	  env.close(function (err) {
+	    assert.ifError(err);
+	    assert(committed);
+	    done();
+	  });
+	} catch (e) {
+	  assert(/transactions still running/.test(e.message));
+	  setImmediate(close_env);
+	}
+      }
+    });
+  }
+
+  function test_sync(done) {
+    console.log("-- test_sync");
+    var fs = require('fs');
+    if (! fs.existsSync("test_sync")) { fs.mkdirSync("test_sync"); }
+    var env = new DbStore.DbEnv();
+    env.open("test_sync", { transactional: true }, function (err) {
+      assert.ifError(err);
+      env.startTrickle({ interval: 10, percent: 50, checkpoint: 20 });
+      var store = new DbStore();
+      store.open("sync.db", { env: env }, function (err) {
+	assert.ifError(err);
+	store.put("synckey", "syncval", function (err) {
+	  assert.ifError(err);
+	  store.sync(function (err) {
+	    assert.ifError(err);
+	    setTimeout(function () {
+	      var stats = env.trickleStats();
+	      assert(stats.runs > 0);
+	      assert(stats.pagesWritten >= stats.lastPagesWritten);
+	      env.stopTrickle();
+	      store.close(function (err) {
+		assert.ifError(err);
+		env.close(done);
+	      });
+	    }, 100);
+	  });
+	});
+      });
+    });
+  }
+
+  function test_access_methods(done) {
+    console.log("-- test_access_methods");
+    var hash = new DbStore();
+    hash.open("hash.db", { type: "hash", hashFillFactor: 40, nelem: 1000 }, function (err) {
+      assert.ifError(err);
+      hash.put("hashkey", "hashval", function (err) {
+	assert.ifError(err);
+	hash.get("hashkey", 'utf8', function (err, val) {
+	  assert.ifError(err);
+	  assert(val == "hashval");
+	  hash.close(function (err) {
+	    assert.ifError(err);
+	    var log = new DbStore();
+	    log.open("log.db", { type: "recno", pageSize: 4096 }, function (err) {
+	      assert.ifError(err);
+	      log.append("first", function (err, recno) {
+		assert.ifError(err);
+		assert(typeof recno == 'number' && recno > 0);
+		log.get(recno, 'utf8', function (err, val) {
+		  assert.ifError(err);
+		  assert(val == "first");
+		  log.close(done);
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  // Close waits for the reads and writes already queued
+  function test_close_waits(done) {
+    console.log("-- test_close_waits");
+    var store = new DbStore(), order = [];
+    store.open("closewait.db", function (err) {
+      assert.ifError(err);
+      store.put("waitkey", "waitval", function (err) {
+	assert.ifError(err);
+	store.get("waitkey", 'utf8', function (err, val) {
+	  assert.ifError(err);
+	  assert(val == "waitval");
+	  order.push("get");
+	});
+	store.stat(function (err) {
+	  assert.ifError(err);
+	  order.push("stat");
+	});
+	store.close(function (err) {
+	  assert.ifError(err);
+	  assert(order.length == 2);
+	  done();
+	});
+	// Closed as far as new work goes, while the queued work drains
+	assert.throws(function () { store.getSync("waitkey"); }, /not open/);
+	assert.throws(function () { store.close(function () {}); }, /already closing/);
+      });
+    });
+  }
+
+  // Deleting the key a hash iterator resumes from is an error, not an
+  // early end
+  function test_hash_iterator(done) {
+    console.log("-- test_hash_iterator");
+    var hash = new DbStore();
+    hash.open("hashiter.db", { type: "hash" }, function (err) {
+      assert.ifError(err);
+      var pairs = [], value = new Array(101).join("h");
+      for (var i = 0; i < 200; i++) {
+	pairs.push(["h" + i, value]);
+      }
+      hash.putMany(pairs, function (err) {
+	assert.ifError(err);
+	var it = hash.iterator({ bufferSize: 4096 }), seen = 0;
+	it.next(function (err, key) {
+	  assert.ifError(err);
+	  seen++;
+	  assert(it.keys.length > 0 && ! it.done);
+	  hash.del(it.keys[it.keys.length - 1], function (err) {
+	    assert.ifError(err);
+	    (function drain() {
+	      it.next(function (err, key) {
+		if (err) {
+		  assert(seen < 200);
+		  it.end();
+		  return hash.close(done);
+		}
+		assert(key !== undefined, "iteration ended early");
+		seen++;
+		drain();
+	      });
+	    })();
+	  });
+	});
+      });
+    });
+  }
+
+  function test_concurrent_gets(done) {
+    console.log("-- test_concurrent_gets");
+    dbstore.put("herd", "v1", function (err) {
+      assert.ifError(err);
+      var pending = 20;
+      for (var i = 0; i < 20; ++i) {
+	dbstore.get("herd", 'utf8', function (err, val) {
+	  assert.ifError(err);
+	  assert(val == "v1");
+	  if (--pending === 0) {
+	    // A write in between must not be answered by the earlier lookup
+	    dbstore.get("herd", function () {});
+	    dbstore.put("herd", "v2", function (err) {
+	      assert.ifError(err);
+	      dbstore.get("herd", 'utf8', function (err, val) {
+		assert.ifError(err);
+		assert(val == "v2");
+		dbstore.del("herd", done);
+	      });
+	    });
+	  }
+	});
+      }
+    });
+  }
+
+  function test_value_cache(done) {
+    console.log("-- test_value_cache");
+    var store = new DbStore();
+    store.open("cached.db", { valueCache: 1024 * 1024 }, function (err) {
+      assert.ifError(err);
+      store.put("ckey", "one", function (err) {
+	assert.ifError(err);
+	store.get("ckey", 'utf8', function (err, val) {
+	  assert.ifError(err);
+	  assert(val == "one");
+	  store.get("ckey", 'utf8', function (err, val) {
+	    assert.ifError(err);
+	    assert(val == "one");
+	    assert(store.cacheStats().hits >= 1);
+	    store.put("ckey", "two", function (err) {
+	      assert.ifError(err);
+	      assert(store.getSync("ckey", 'utf8') == "two");
+	      store.del("ckey", function (err) {
+		assert.ifError(err);
+		store.get("ckey", function (err) {
+		  assert(err);
+		  store.close(done);
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  function test_compress(done) {
+    console.log("-- test_compress");
+    var store = new DbStore();
+    var big = new Array(200).join("compressible ");
+    store.open("compressed.db", { compress: 'deflate', compressThreshold: 64 }, function (err) {
+      assert.ifError(err);
+      store.putMany([["small", "tiny"], ["big", big]], function (err) {
+	assert.ifError(err);
+	store.getMany(["small", "big"], 'utf8', function (err, vals) {
+	  assert.ifError(err);
+	  assert(vals[0] == "tiny" && vals[1] == big);
+	  store.put("big2", big, function (err) {
+	    assert.ifError(err);
+	    assert(store.getSync("big2", 'utf8') == big);
+	    store.close(done);
+	  });
+	});
+      });
+    });
+  }
+
+  function test_btree_compress(done) {
+    console.log("-- test_btree_compress");
+    var store = new DbStore();
+    store.open("prefixed.db", { btreeCompress: true }, function (err) {
+      assert.ifError(err);
+      var pairs = [];
+      for (var i = 0; i < 100; ++i) {
+	pairs.push(["user:profile:" + (1000 + i), "value " + i]);
+      }
+      store.putMany(pairs, function (err) {
+	assert.ifError(err);
+	store.get("user:profile:1042", 'utf8', function (err, val) {
+	  assert.ifError(err);
+	  assert(val == "value 42");
+	  store.close(done);
+	});
+      });
+    });
+  }
+
+  function test_write_behind(done) {
+    console.log("-- test_write_behind");
+    var store = new DbStore();
+    store.open("behind.db", { writeBehind: { interval: 50 } }, function (err) {
+      assert.ifError(err);
+      store.put("wb1", "one", function (err) {
+	assert.ifError(err);
+	assert(store.getSync("wb1", 'utf8') == "one");
+	store.del("wb1", function (err) {
+	  assert.ifError(err);
+	  assert(store.getSync("wb1") === undefined);
+	  store.putMany([["wb2", "two"], ["wb3", "three"]], function (err) {
+	    assert.ifError(err);
+	    store.flush(function (err) {
+	      assert.ifError(err);
+	      store.getMany(["wb1", "wb2", "wb3"], 'utf8', function (err, vals) {
+		assert.ifError(err);
+		assert(vals[0] === undefined && vals[1] == "two" && vals[2] == "three");
+		store.close(done);
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  function test_stats(done) {
+    console.log("-- test_stats");
+    dbstore.put("timed", "value", function (err) {
+      assert.ifError(err);
+      dbstore.get("timed", function (err) {
+	assert.ifError(err);
+	var stats = dbstore.stats({ reset: true });
+	var get = stats.get;
+	assert(get.total.count >= 1);
+	assert(get.queue.p50 <= get.queue.p99 && get.exec.p99 <= get.exec.max);
+	assert(stats.put.total.count >= 1);
+	assert(dbstore.stats().get === undefined);
+	dbstore.del("timed", done);
+      });
+    });
+  }
+
+  function test_stat(done) {
+    console.log("-- test_stat");
+    dbstore.stat({ fast: true }, function (err, stats) {
+      assert.ifError(err);
+      assert(stats.pageSize > 0);
+      dbstore.stat(function (err, stats) {
+	assert.ifError(err);
+	assert(stats.levels >= 1 && stats.leafPages >= 1);
+	assert(stats.leafFill > 0 && stats.leafFill <= 1);
+	assert(stats.cache.hits + stats.cache.misses > 0);
+	done();
+      });
+    });
+  }
+
+  function test_ttl(done) {
+    console.log("-- test_ttl");
+    assert.throws(function () { dbstore.put("short", "lived", { ttl: 1 }, function () {}); });
+
+    var store = new DbStore();
+    store.open("expiring.db", { ttl: { sweepInterval: 50 }, compress: 'deflate' }, function (err) {
+      assert.ifError(err);
+      store.put("short", "lived", { ttl: 1 }, function (err) {
+	assert.ifError(err);
+	store.putMany([["long", "lived"], ["brief", "too"]], { ttl: 3600 }, function (err) {
+	  assert.ifError(err);
+	  store.put("forever", "kept", function (err) {
+	    assert.ifError(err);
+	    assert(store.getSync("short", 'utf8') == "lived");
+	    setTimeout(function () {
+	      assert(store.getSync("short") === undefined);
+	      store.getMany(["short", "long", "forever"], 'utf8', function (err, vals) {
+		assert.ifError(err);
+		assert(vals[0] === undefined && vals[1] == "lived" && vals[2] == "kept");
+		var stats = store.sweepStats();
+		assert(stats.runs > 0 && stats.expired == 1);
+		store.close(done);
+	      });
+	    }, 2100);
+	  });
+	});
+      });
+    });
+  }
+
+  function test_indexes(done) {
+    console.log("-- test_indexes");
+    var store = new DbStore();
+    var indexes = {
+      byCountry: { offset: 0, length: 2 },
+      byUser: { field: 1, delimiter: ':' },
+      byCity: { path: 'address.city' }
+    };
+    store.open("indexed.db", { indexes: indexes, compress: 'deflate' }, function (err) {
+      assert.ifError(err);
+      store.putMany([
+	["a", "NZ:ann:1"], ["b", "NZ:bob:2"], ["c", "UK:ann:3"],
+	["d", JSON.stringify({ name: "dan", address: { city: "Wellington" } })]
+      ], function (err) {
+	assert.ifError(err);
+	store.query("byCountry", "NZ", function (err, records) {
+	  assert.ifError(err);
+	  assert(records.length == 2 && records[0].key == "a" && records[1].key == "b");
+	  store.join([["byCountry", "NZ"], ["byUser", "ann"]], function (err, records) {
+	    assert.ifError(err);
+	    assert(records.length == 1 && records[0].key == "a");
+	    store.del("a", function (err) {
+	      assert.ifError(err);
+	      store.query("byUser", "ann", function (err, records) {
+		assert.ifError(err);
+		assert(records.length == 1 && records[0].key == "c");
+		store.query("byCity", "Wellington", { json: true }, function (err, records) {
+		  assert.ifError(err);
+		  assert(records.length == 1 && records[0].value.name == "dan");
+		  store.close(done);
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  function test_partition(done) {
+    console.log("-- test_partition");
+    var fs = require('fs');
+    ["test_part1", "test_part2"].forEach(function (dir) {
+      if (! fs.existsSync(dir)) { fs.mkdirSync(dir); }
+    });
+    var ranged = new DbStore();
+    ranged.open("ranged.db", { partition: { keys: ["p:h", "p:p"] } }, function (err) {
+      assert.ifError(err);
+      ranged.putMany([["p:a", "1"], ["p:k", "2"], ["p:z", "3"]], function (err) {
+	assert.ifError(err);
+	var keys = [];
+	ranged.createReadStream({ prefix: "p:" }).on('data', function (rec) {
+	  keys.push(rec.key);
+	}).on('end', function () {
+	  assert(keys.join() == "p:a,p:k,p:z");
+	  ranged.close(function (err) {
+	    assert.ifError(err);
+	    var hashed = new DbStore();
+	    var partition = { count: 4, dirs: ["test_part1", "test_part2"] };
+	    hashed.open("hashed.db", { partition: partition }, function (err) {
+	      assert.ifError(err);
+	      hashed.putMany([["one", "1"], ["two", "2"], ["three", "3"]], function (err) {
+		assert.ifError(err);
+		hashed.getMany(["one", "two", "three"], 'utf8', function (err, vals) {
+		  assert.ifError(err);
+		  assert(vals.join() == "1,2,3");
+		  hashed.close(function (err) {
+		    assert.ifError(err);
+		    test_partition_reopen(done);
+		  });
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+  }
+
+  // A rejected open leaves the store as it was, ready to open properly
+  function test_partition_reopen(done) {
+    var store = new DbStore();
+    assert.throws(function () {
+      store.open("reopen.db", { ttl: true, writeBehind: true, valueCache: 1024,
+				partition: { keys: ["p:n", "p:c"] } }, function () {});
+    });
+    assert(store.sweepStats() === undefined);
+    store.open("reopen.db", { partition: { keys: ["p:n"] } }, function (err) {
+      assert.ifError(err);
+      store.put("p:x", "reopened", function (err) {
+	assert.ifError(err);
+	store.get("p:x", 'utf8', function (err, val) {
+	  assert.ifError(err);
+	  assert(val == "reopened");
+	  store.close(done);
+	});
+      });
+    });
+  }
+
+  function test_compact(done) {
+    console.log("-- test_compact");
+    var fs = require('fs');
+    if (! fs.existsSync("test_compact")) { fs.mkdirSync("test_compact"); }
+    // Stores without page locking can't be compacted
+    assert.throws(function () { dbstore.compact(function () {}); });
+    var env = new DbStore.DbEnv(), store = new DbStore();
+    env.open("test_compact", { transactional: true }, function (err) {
+      assert.ifError(err);
+      store.open("compact.db", { env: env }, compacted);
+    });
+    function compacted(err) {
+      assert.ifError(err);
+      var pairs = [], value = new Array(101).join("x");
+      for (var i = 0; i < 2000; i++) {
+	pairs.push(["c:" + (10000 + i), value]);
+      }
+      store.putMany(pairs, function (err) {
+	assert.ifError(err);
+	// Leave one record in ten
+	var left = 0;
+	pairs.forEach(function (pair, i) {
+	  if (i % 10 == 0) { return; }
+	  left++;
+	  store.del(pair[0], function (err) {
+	    assert.ifError(err);
+	    if (--left) { return; }
+	    store.compact({ maxPages: 1 }, function (err, res) {
+	      assert.ifError(err);
+	      assert(res.slices == 1 && ! res.done);
+	      store.compact({ fillPercent: 90, freeSpace: true }, function (err, res) {
+		assert.ifError(err);
+		assert(res.done && res.pagesFreed > 0);
+		store.get("c:10010", 'utf8', function (err, val) {
+		  assert.ifError(err);
+		  assert(val == value);
+		  store.close(function (err) {
+		    assert.ifError(err);
+		    env.close(done);
+		  });
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    }
+  }
+
+  function test_concurrent(done) {
+    console.log("-- test_concurrent");
+    var fs = require('fs');
+    if (! fs.existsSync("test_cds")) { fs.mkdirSync("test_cds"); }
+    // Two handles on one home stand in for two processes
+    var env1 = new DbStore.DbEnv(), env2 = new DbStore.DbEnv();
+    var writer = new DbStore(), reader = new DbStore();
+    assert.throws(function () {
+      env1.open("test_cds", { concurrent: true, transactional: true }, function () {});
+    });
+    env1.open("test_cds", { concurrent: true }, function (err) {
+      assert.ifError(err);
+      env2.open("test_cds", { concurrent: true }, function (err) {
+	assert.ifError(err);
+	writer.open("cds.db", { env: env1 }, function (err) {
+	  assert.ifError(err);
+	  reader.open("cds.db", { env: env2 }, function (err) {
+	    assert.ifError(err);
+	    writer.put("cdskey", "cdsval", function (err) {
+	      assert.ifError(err);
+	      reader.get("cdskey", 'utf8', function (err, val) {
+		assert.ifError(err);
+		assert(val == "cdsval");
+		assert.throws(function () { reader.compact(function () {}); });
+		env1.stat(function (err, stats) {
+		  assert.ifError(err);
+		  assert(stats.lock && stats.txn === undefined);
+		  close();
+		});
+	      });
+	    });
+	  });
+	});
+      });
+    });
+    function close() {
+      reader.close(function (err) {
+	assert.ifError(err);
+	writer.close(function (err) {
+	  assert.ifError(err);
+	  env2.close(function (err) {
+	    assert.ifError(err);
+	    env1.close(done);
+	  });
+	});
+      });
+    }
+  }
+
+  async.series([
+    test_put_get, test_json, test_get_sync, test_put_many, test_get_many,
+    test_scan, test_binary_keys, test_env, test_txn, test_group_close,
+    test_sync, test_access_methods, test_hash_iterator, test_concurrent_gets,
+    test_close_waits, test_value_cache, test_compress, test_btree_compress,
+    test_write_behind, test_stats, test_stat, test_ttl, test_indexes,
+    test_partition, test_compact, test_concurrent
+  ], function (err) {
     assert.ifError(err);
     dbstore.close(function (err, val) {
       console.log("closed" + (err ? ": " + err.stack : " ret=" + val));